@@ -0,0 +1,303 @@
+// File: bench.cpp
+// Benchmark suite: fork/join, barrier and task-submit latency, strong/weak scaling, vector-add and scan GB/s,
+// naive and blocked (sm::gemm) matmul GFLOP/s, sort Mkeys/s and imbalance under skewed work. Every measurement is
+// repeated and reported as percentiles, as CSV on stdout (or --csv file)
+// and optionally as JSON (--json file).
+//
+//   ./bench [--threads N] [--reps R] [--quick] [--csv file] [--json file]
+#include "simple-multithreader.h"
+#include "sm-gemm.h"
+#include "sm-elementwise.h"
+#include "sm-sort.h"
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+struct Result {
+  std::string bench;      // e.g. "vector_add_strong"
+  std::string variant;    // schedule or kernel variant
+  int threads;
+  long long size;         // problem size (indices, or matrix order)
+  std::string unit;
+  std::vector<double> samples;
+};
+
+static double percentile(std::vector<double> v, double p) {
+  if (v.empty()) return 0.0;
+  std::sort(v.begin(), v.end());
+  double pos = p / 100.0 * (v.size() - 1);
+  size_t lo = static_cast<size_t>(pos);
+  size_t hi = std::min(lo + 1, v.size() - 1);
+  return v[lo] + (v[hi] - v[lo]) * (pos - lo);
+}
+
+static double mean(const std::vector<double> &v) {
+  double s = 0;
+  for (double x : v) s += x;
+  return v.empty() ? 0.0 : s / v.size();
+}
+
+static void write_csv(FILE *f, const std::vector<Result> &results) {
+  fprintf(f, "bench,variant,threads,size,unit,reps,min,p50,p90,p99,max,mean\n");
+  for (const Result &r : results) {
+    fprintf(f, "%s,%s,%d,%lld,%s,%zu,%.6g,%.6g,%.6g,%.6g,%.6g,%.6g\n", r.bench.c_str(), r.variant.c_str(),
+            r.threads, r.size, r.unit.c_str(), r.samples.size(), percentile(r.samples, 0),
+            percentile(r.samples, 50), percentile(r.samples, 90), percentile(r.samples, 99),
+            percentile(r.samples, 100), mean(r.samples));
+  }
+}
+
+static void write_json(FILE *f, const std::vector<Result> &results) {
+  fprintf(f, "[\n");
+  for (size_t k = 0; k < results.size(); ++k) {
+    const Result &r = results[k];
+    fprintf(f, "  {\"bench\": \"%s\", \"variant\": \"%s\", \"threads\": %d, \"size\": %lld, \"unit\": \"%s\", "
+               "\"reps\": %zu, \"min\": %.6g, \"p50\": %.6g, \"p90\": %.6g, \"p99\": %.6g, \"max\": %.6g, "
+               "\"mean\": %.6g}%s\n",
+            r.bench.c_str(), r.variant.c_str(), r.threads, r.size, r.unit.c_str(), r.samples.size(),
+            percentile(r.samples, 0), percentile(r.samples, 50), percentile(r.samples, 90),
+            percentile(r.samples, 99), percentile(r.samples, 100), mean(r.samples),
+            k + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "]\n");
+}
+
+// keeps the imbalance ratio of the last call
+struct LastCall : SM_Observer {
+  double imbalance = 1.0;
+  void on_call(const SM_CallStats &st) override { imbalance = st.imbalance; }
+};
+
+struct NamedSchedule {
+  const char *name;
+  SM_Schedule sched;
+};
+
+int main(int argc, char **argv) {
+  int maxThreads = sm_cpu_count();
+  int reps = 10;
+  bool quick = false;
+  const char *csvPath = nullptr;
+  const char *jsonPath = nullptr;
+  for (int a = 1; a < argc; ++a) {
+    if (!strcmp(argv[a], "--threads") && a + 1 < argc) maxThreads = atoi(argv[++a]);
+    else if (!strcmp(argv[a], "--reps") && a + 1 < argc) reps = atoi(argv[++a]);
+    else if (!strcmp(argv[a], "--quick")) quick = true;
+    else if (!strcmp(argv[a], "--csv") && a + 1 < argc) csvPath = argv[++a];
+    else if (!strcmp(argv[a], "--json") && a + 1 < argc) jsonPath = argv[++a];
+    else {
+      fprintf(stderr, "usage: %s [--threads N] [--reps R] [--quick] [--csv file] [--json file]\n", argv[0]);
+      return 1;
+    }
+  }
+  maxThreads = std::max(1, maxThreads);
+  reps = std::max(1, reps);
+
+  // thread counts 1, 2, 4, ... plus maxThreads itself
+  std::vector<int> threadCounts;
+  for (int t = 1; t < maxThreads; t *= 2) threadCounts.push_back(t);
+  threadCounts.push_back(maxThreads);
+
+  NamedSchedule schedules[] = {
+    {"steal", sm_schedule_steal()},
+    {"static", sm_schedule_static()},
+    {"dynamic", sm_schedule_dynamic()},
+    {"guided", sm_schedule_guided()},
+  };
+  std::vector<Result> results;
+
+  // warm the pool so worker start-up is not measured
+  parallel_for(0, maxThreads, [](int) {}, maxThreads);
+
+  // 1. fork/join latency of an empty body, per call
+  int calls = quick ? 200 : 2000;
+  for (int t : threadCounts) {
+    for (const NamedSchedule &s : schedules) {
+      Result r = {"forkjoin_empty", s.name, t, t, "us", {}};
+      for (int c = 0; c < calls; ++c) {
+        long long t0 = sm_now_ns();
+        parallel_for(0, t, [](int) {}, t, s.sched);
+        r.samples.push_back((sm_now_ns() - t0) / 1e3);
+      }
+      results.push_back(r);
+    }
+  }
+
+  // 1b. SM_Barrier round trip: t threads each cross the barrier `calls` times
+  // inside one static call; reported per crossing
+  for (int t : threadCounts) {
+    Result r = {"barrier", "spin-futex", t, t, "us", {}};
+    SM_Barrier barrier(t);
+    for (int rep = 0; rep < reps; ++rep) {
+      long long t0 = sm_now_ns();
+      parallel_for_range(0, t, [&](int b, int e) {
+        for (int piece = b; piece < e; ++piece) {
+          for (int c = 0; c < calls; ++c) barrier.arrive_and_wait();
+        }
+      }, t, sm_schedule_static());
+      r.samples.push_back((sm_now_ns() - t0) / 1e3 / calls);
+    }
+    results.push_back(r);
+  }
+
+  // 1c. independent tasks: submit `calls` empty tasks to an SM_TaskSet and wait; reported per task
+  {
+    Result r = {"task_submit", "mpmc", maxThreads, calls, "ns", {}};
+    for (int rep = 0; rep < reps; ++rep) {
+      SM_TaskSet tasks;
+      long long t0 = sm_now_ns();
+      for (int c = 0; c < calls; ++c) tasks.submit([] {});
+      tasks.wait();
+      r.samples.push_back(static_cast<double>(sm_now_ns() - t0) / calls);
+    }
+    results.push_back(r);
+  }
+
+  // 2. vector add C = A + B (parallel_for and sm::transform): strong scaling (fixed n) and weak scaling
+  // (fixed n per thread), in GB/s of the three streams
+  long long strongN = quick ? (1LL << 21) : (1LL << 24);
+  long long weakPerThread = quick ? (1LL << 19) : (1LL << 22);
+  long long maxN = std::max(strongN, weakPerThread * maxThreads);
+  std::vector<float> A(maxN, 1.0f), B(maxN, 2.0f), C(maxN, 0.0f);
+  for (int t : threadCounts) {
+    const char *names[] = {"vector_add_strong", "vector_add_weak"};
+    long long sizes[] = {strongN, weakPerThread * t};
+    for (int k = 0; k < 2; ++k) {
+      long long n = sizes[k];
+      Result r = {names[k], "steal", t, n, "GB/s", {}};
+      for (int rep = 0; rep < reps; ++rep) {
+        long long t0 = sm_now_ns();
+        parallel_for(0LL, n, [&](long long i) { C[i] = A[i] + B[i]; }, t);
+        double sec = (sm_now_ns() - t0) / 1e9;
+        r.samples.push_back(3.0 * sizeof(float) * n / sec / 1e9);
+      }
+      results.push_back(r);
+      Result s = {names[k], "sm::transform", t, n, "GB/s", {}};
+      for (int rep = 0; rep < reps; ++rep) {
+        long long t0 = sm_now_ns();
+        sm::transform(A.data(), A.data() + n, B.data(), C.data(), [](float a, float b) { return a + b; }, t);
+        double sec = (sm_now_ns() - t0) / 1e9;
+        s.samples.push_back(3.0 * sizeof(float) * n / sec / 1e9);
+      }
+      results.push_back(s);
+      Result h = {names[k], "streaming", t, n, "GB/s", {}};
+      for (int rep = 0; rep < reps; ++rep) {
+        long long t0 = sm_now_ns();
+        parallel_for(0LL, n, [&](long long i) { C[i] = A[i] + B[i]; }, t, sm_schedule_streaming());
+        double sec = (sm_now_ns() - t0) / 1e9;
+        h.samples.push_back(3.0 * sizeof(float) * n / sec / 1e9);
+      }
+      results.push_back(h);
+    }
+  }
+
+  // 2b. inclusive prefix sum of A into C, in GB/s of one read and one write
+  for (int t : threadCounts) {
+    Result r = {"scan", "parallel_scan", t, strongN, "GB/s", {}};
+    for (int rep = 0; rep < reps; ++rep) {
+      long long t0 = sm_now_ns();
+      parallel_scan(0LL, strongN, A.data(), C.data(), std::plus<float>(), t);
+      double sec = (sm_now_ns() - t0) / 1e9;
+      r.samples.push_back(2.0 * sizeof(float) * strongN / sec / 1e9);
+    }
+    results.push_back(r);
+  }
+
+  // 3. naive matmul (the matrix.cpp kernel over contiguous storage), GFLOP/s
+  int m = quick ? 192 : 512;
+  std::vector<float> MA(static_cast<size_t>(m) * m, 1.0f), MB(MA.size(), 1.0f), MC(MA.size(), 0.0f);
+  for (int t : threadCounts) {
+    Result r = {"matmul_naive", "steal", t, m, "GFLOP/s", {}};
+    for (int rep = 0; rep < std::max(1, reps / 2); ++rep) {
+      long long t0 = sm_now_ns();
+      parallel_for(0, m, 0, m, [&](int i, int j) {
+        float sum = 0;
+        for (int k = 0; k < m; k++) sum += MA[i * m + k] * MB[k * m + j];
+        MC[i * m + j] = sum;
+      }, t);
+      double sec = (sm_now_ns() - t0) / 1e9;
+      r.samples.push_back(2.0 * m * m * m / sec / 1e9);
+    }
+    results.push_back(r);
+    Result g = {"matmul_gemm", "sm::gemm", t, m, "GFLOP/s", {}};
+    for (int rep = 0; rep < reps; ++rep) {
+      long long t0 = sm_now_ns();
+      sm::gemm(m, m, m, MA.data(), m, MB.data(), m, MC.data(), m, t);
+      double sec = (sm_now_ns() - t0) / 1e9;
+      g.samples.push_back(2.0 * m * m * m / sec / 1e9);
+    }
+    results.push_back(g);
+  }
+
+  // 3b. sm::parallel_sort of random keys: radix (uint32) and samplesort
+  // (double), in Mkeys/s; the input is restored before each timed run
+  long long sortN = quick ? (1LL << 20) : (1LL << 23);
+  std::vector<unsigned> keySrc(sortN), keys(sortN);
+  std::vector<double> dblSrc(sortN), dbls(sortN);
+  unsigned long long seed = 88172645463325252ULL;
+  for (long long i = 0; i < sortN; ++i) {
+    seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+    keySrc[i] = static_cast<unsigned>(seed);
+    dblSrc[i] = static_cast<double>(seed >> 11);
+  }
+  for (int t : threadCounts) {
+    Result r = {"sort", "radix(uint32)", t, sortN, "Mkeys/s", {}};
+    Result d = {"sort", "samplesort(double)", t, sortN, "Mkeys/s", {}};
+    for (int rep = 0; rep < std::max(1, reps / 2); ++rep) {
+      keys = keySrc;
+      long long t0 = sm_now_ns();
+      sm::parallel_sort(keys.data(), keys.data() + sortN, std::less<unsigned>(), t);
+      r.samples.push_back(sortN / ((sm_now_ns() - t0) / 1e9) / 1e6);
+      dbls = dblSrc;
+      t0 = sm_now_ns();
+      sm::parallel_sort(dbls.data(), dbls.data() + sortN, std::less<double>(), t);
+      d.samples.push_back(sortN / ((sm_now_ns() - t0) / 1e9) / 1e6);
+    }
+    results.push_back(r);
+    results.push_back(d);
+  }
+
+  // 4. skewed work (index i costs ~i units): imbalance ratio and time per schedule
+  int skewN = quick ? 2048 : 8192;
+  LastCall last;
+  std::vector<double> sink(skewN);
+  for (const NamedSchedule &s : schedules) {
+    Result ratio = {"skewed_imbalance", s.name, maxThreads, skewN, "max/mean busy", {}};
+    Result time = {"skewed_time", s.name, maxThreads, skewN, "ms", {}};
+    for (int rep = 0; rep < reps; ++rep) {
+      sm_set_observer(&last);
+      long long t0 = sm_now_ns();
+      parallel_for(0, skewN, [&](int i) {
+        double x = i;
+        for (int k = 0; k < i; k++) x = x * 0.999 + 1.0;
+        sink[i] = x;
+      }, maxThreads, s.sched);
+      time.samples.push_back((sm_now_ns() - t0) / 1e6);
+      sm_set_observer(nullptr);
+      ratio.samples.push_back(last.imbalance);
+    }
+    results.push_back(ratio);
+    results.push_back(time);
+  }
+
+  FILE *csv = csvPath ? fopen(csvPath, "w") : stdout;
+  if (!csv) {
+    perror(csvPath);
+    return 1;
+  }
+  write_csv(csv, results);
+  if (csv != stdout) fclose(csv);
+  if (jsonPath) {
+    FILE *json = fopen(jsonPath, "w");
+    if (!json) {
+      perror(jsonPath);
+      return 1;
+    }
+    write_json(json, results);
+    fclose(json);
+  }
+  return 0;
+}
@@ -1,51 +1,57 @@
-// File: matrix.cpp
-#include "simple-multithreader.h"
-#include <assert.h>
-#include <cstdlib>
-#include <algorithm>
-#include <cstdio>
-
-int main(int argc, char** argv) {
-  // initialize problem size
-  int numThread = argc > 1 ? atoi(argv[1]) : 2;
-  int size = argc > 2 ? atoi(argv[2]) : 1024;
-  // allocate matrices (array of pointers)
-  int** A = new int*[size];
-  int** B = new int*[size];
-  int** C = new int*[size];
-
-  // allocate rows in parallel
-  parallel_for(0, size, [=](int i) {
-    A[i] = new int[size];
-    B[i] = new int[size];
-    C[i] = new int[size];
-    std::fill(A[i], A[i] + size, 1);
-    std::fill(B[i], B[i] + size, 1);
-    std::fill(C[i], C[i] + size, 0);
-  }, numThread);
-
-  // start the parallel multiplication of two matrices
-  parallel_for(0, size, 0, size, [&](int i, int j) {
-    int sum = 0;
-    for (int k = 0; k < size; k++) {
-      sum += A[i][k] * B[k][j];
-    }
-    C[i][j] = sum;
-  }, numThread);
-
-  // verify the result matrix
-  for (int i = 0; i < size; i++) for (int j = 0; j < size; j++) assert(C[i][j] == size);
-  printf("Test Success. \n");
-
-  // cleanup memory in parallel
-  parallel_for(0, size, [=](int i) {
-    delete [] A[i];
-    delete [] B[i];
-    delete [] C[i];
-  }, numThread);
-
-  delete[] A;
-  delete[] B;
-  delete[] C;
-  return 0;
-}
+// File: matrix.cpp
+#include "simple-multithreader.h"
+#include "sm-gemm.h"
+#include "sm-matrix.h"
+#include <assert.h>
+#include <cstdlib>
+#include <cstdio>
+
+int main(int argc, char** argv) {
+  // initialize problem size
+  // numThread 0 (the default) lets the library choose
+  int numThread = argc > 1 ? atoi(argv[1]) : 0;
+  int size = argc > 2 ? atoi(argv[2]) : 1024;
+  // allocate matrices: one aligned, padded buffer each, initialized in
+  // parallel so each band of rows is first touched by the thread that the
+  // pipeline below runs it on
+  sm::Matrix<int> A(size, size, 1, numThread);
+  sm::Matrix<int> B(size, size, 1, numThread);
+  sm::Matrix<int> C(size, size, 0, numThread);
+
+  // the blocked SIMD kernel, for comparison
+  sm::Matrix<int> G(size, size, 0, numThread);
+  long long t0 = sm_now_ns();
+  sm::gemm(size, size, size, A.data(), A.stride(), B.data(), B.stride(), G.data(), G.stride(), numThread);
+  printf("[matrix] sm::gemm time = %.3f ms\n", (sm_now_ns() - t0) / 1e6);
+
+  // print the timing of each parallel call (the naive multiply below runs
+  // as part of the pipeline)
+  SM_PrintObserver printer;
+  sm_set_observer(&printer);
+
+  // multiply -> verify as one pipeline: each band of rows is checked as
+  // soon as it has been computed, with no barrier between the phases
+  SM_Pipeline rows(numThread);
+  int multiply = rows.stage(0, size, [&](int i) {
+    for (int j = 0; j < size; j++) {
+      int sum = 0;
+      for (int k = 0; k < size; k++) {
+        sum += A[i][k] * B[k][j];
+      }
+      C[i][j] = sum;
+    }
+  });
+
+  // verify the result matrix, and that sm::gemm agrees with it
+  int verify = rows.stage(0, size, [&](int i) {
+    for (int j = 0; j < size; j++) {
+      assert(C[i][j] == size);
+      assert(G[i][j] == C[i][j]);
+    }
+  });
+  rows.depend_same(verify, multiply);
+
+  rows.run();
+  printf("Test Success. \n");
+  return 0;
+}
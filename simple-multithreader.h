@@ -1,181 +1,3777 @@
-#ifndef SIMPLE_MULTITHREADER_H
-#define SIMPLE_MULTITHREADER_H
-
-// simple-multithreader.h
-// Header-only Pthreads-based simple parallel_for (C++11 lambda support).
-// Compile with: g++ -std=c++11 -pthread ...
-
-#include <pthread.h>
-#include <functional>
-#include <memory>
-#include <vector>
-#include <chrono>
-#include <iostream>
-#include <stdexcept>
-#include <climits>
-
-// Internal helper: millisecond timestamp
-inline long long sm_now_ms() {
-    using namespace std::chrono;
-    return std::chrono::duration_cast<std::chrono::milliseconds>(
-               std::chrono::steady_clock::now().time_since_epoch())
-        .count();
-}
-
-// Thread argument struct template (used for 1D and 2D)
-template<typename LambdaType>
-struct SM_ThreadArg {
-    std::shared_ptr<LambdaType> lambda;
-    int start_idx;
-    int end_idx;
-    int low1;
-    int low2;
-    int width2;
-    SM_ThreadArg(std::shared_ptr<LambdaType> l, int s, int e)
-        : lambda(l), start_idx(s), end_idx(e), low1(0), low2(0), width2(0) {}
-};
-
-// pthread entry for 1D
-inline void *sm_thread_entry_1d(void *arg_void) {
-    auto *arg = static_cast<SM_ThreadArg<std::function<void(int)> >*>(arg_void);
-    if (!arg) return nullptr;
-    try {
-        auto f = arg->lambda;
-        for (int i = arg->start_idx; i < arg->end_idx; ++i) (*f)(i);
-    } catch (...) { /* do not propagate */ }
-    delete arg;
-    return nullptr;
-}
-
-// pthread entry for 2D (flattened)
-inline void *sm_thread_entry_2d(void *arg_void) {
-    auto *arg = static_cast<SM_ThreadArg<std::function<void(int,int)> >*>(arg_void);
-    if (!arg) return nullptr;
-    try {
-        auto f = arg->lambda;
-        int s = arg->start_idx;
-        int e = arg->end_idx;
-        int low1 = arg->low1;
-        int low2 = arg->low2;
-        int w = arg->width2;
-        for (int flat = s; flat < e; ++flat) {
-            int i = flat / w + low1;
-            int j = flat % w + low2;
-            (*f)(i, j);
-        }
-    } catch (...) {}
-    delete arg;
-    return nullptr;
-}
-
-// split [low, high) into num pieces (contiguous)
-inline std::vector<std::pair<int,int>> sm_split_range(int low, int high, int numPieces) {
-    std::vector<std::pair<int,int>> parts;
-    if (numPieces <= 0) return parts;
-    if (low >= high) {
-        for (int k = 0; k < numPieces; ++k) parts.emplace_back(low, low);
-        return parts;
-    }
-    int total = high - low;
-    int base = total / numPieces;
-    int rem = total % numPieces;
-    int cur = low;
-    for (int t = 0; t < numPieces; ++t) {
-        int add = base + (t < rem ? 1 : 0);
-        int s = cur;
-        int e = cur + add;
-        parts.emplace_back(s, e);
-        cur = e;
-    }
-    return parts;
-}
-
-// Public API - 1D
-inline void parallel_for(int low, int high, std::function<void(int)> &&lambda, int numThreads) {
-    if (numThreads <= 0) numThreads = 1;
-    if (low >= high) return;
-
-    long long t0 = sm_now_ms();
-
-    auto parts = sm_split_range(low, high, numThreads);
-    if ((int)parts.size() != numThreads) { parts = sm_split_range(low, high, 1); numThreads = 1; }
-
-    auto shared_lambda = std::make_shared<std::function<void(int)>>(std::move(lambda));
-    int to_create = numThreads - 1;
-    std::vector<pthread_t> tids;
-    tids.reserve(std::max(0, to_create));
-
-    for (int t = 0; t < to_create; ++t) {
-        auto *arg = new SM_ThreadArg<std::function<void(int)>>(shared_lambda, parts[t].first, parts[t].second);
-        pthread_t tid;
-        if (pthread_create(&tid, nullptr, sm_thread_entry_1d, arg) != 0) {
-            delete arg;
-            for (pthread_t &pt : tids) pthread_join(pt, nullptr);
-            throw std::runtime_error("pthread_create failed (1D)");
-        }
-        tids.push_back(tid);
-    }
-
-    // main thread does last piece
-    int main_idx = to_create;
-    for (int i = parts[main_idx].first; i < parts[main_idx].second; ++i) (*shared_lambda)(i);
-
-    for (pthread_t &pt : tids) pthread_join(pt, nullptr);
-
-    long long t1 = sm_now_ms();
-    std::cout << "[SimpleMultithreader] parallel_for(1D) time = " << (t1 - t0) << " ms\n";
-}
-
-// Public API - 2D (low1..high1, low2..high2)
-inline void parallel_for(int low1, int high1, int low2, int high2,
-                         std::function<void(int,int)> &&lambda, int numThreads) {
-    if (numThreads <= 0) numThreads = 1;
-    if (low1 >= high1 || low2 >= high2) return;
-
-    long long rows = static_cast<long long>(high1 - low1);
-    long long cols = static_cast<long long>(high2 - low2);
-    long long total = rows * cols;
-    if (total <= 0) return;
-    if (total > INT_MAX) throw std::runtime_error("2D range too large");
-
-    long long t0 = sm_now_ms();
-
-    int total_int = static_cast<int>(total);
-    auto parts = sm_split_range(0, total_int, numThreads);
-    if ((int)parts.size() != numThreads) { parts = sm_split_range(0, total_int, 1); numThreads = 1; }
-
-    auto shared_lambda = std::make_shared<std::function<void(int,int)>>(std::move(lambda));
-    int to_create = numThreads - 1;
-    std::vector<pthread_t> tids;
-    tids.reserve(std::max(0, to_create));
-
-    for (int t = 0; t < to_create; ++t) {
-        auto *arg = new SM_ThreadArg<std::function<void(int,int)>>(shared_lambda, parts[t].first, parts[t].second);
-        arg->low1 = low1;
-        arg->low2 = low2;
-        arg->width2 = static_cast<int>(cols);
-        pthread_t tid;
-        if (pthread_create(&tid, nullptr, sm_thread_entry_2d, arg) != 0) {
-            delete arg;
-            for (pthread_t &pt : tids) pthread_join(pt, nullptr);
-            throw std::runtime_error("pthread_create failed (2D)");
-        }
-        tids.push_back(tid);
-    }
-
-    // main thread piece
-    int main_idx = to_create;
-    int w = static_cast<int>(cols);
-    for (int flat = parts[main_idx].first; flat < parts[main_idx].second; ++flat) {
-        int i = flat / w + low1;
-        int j = flat % w + low2;
-        (*shared_lambda)(i, j);
-    }
-
-    for (pthread_t &pt : tids) pthread_join(pt, nullptr);
-
-    long long t1 = sm_now_ms();
-    std::cout << "[SimpleMultithreader] parallel_for(2D) time = " << (t1 - t0) << " ms\n";
-}
-
-#endif // SIMPLE_MULTITHREADER_H
+#ifndef SIMPLE_MULTITHREADER_H
+#define SIMPLE_MULTITHREADER_H
+
+// simple-multithreader.h
+// Header-only Pthreads-based simple parallel_for (C++11 lambda support).
+// Compile with: g++ -std=c++11 -pthread ...
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <stdlib.h>
+#include <new>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <exception>
+#include <climits>
+#include <atomic>
+#include <deque>
+#include <algorithm>
+#include <type_traits>
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// C++20 coroutine support (sm::parallel_for_co): on when the compiler and
+// library provide <coroutine>, off otherwise; -DSM_COROUTINES=0 drops it
+#ifndef SM_COROUTINES
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define SM_COROUTINES 1
+#endif
+#endif
+#endif
+#ifndef SM_COROUTINES
+#define SM_COROUTINES 0
+#endif
+#if SM_COROUTINES
+#include <coroutine>
+#endif
+
+// Assumed cache line size for padding shared hot data
+#define SM_CACHE_LINE 64
+
+// Build with -DSM_INSTRUMENTATION=0 to compile the observer hooks out entirely
+#ifndef SM_INSTRUMENTATION
+#define SM_INSTRUMENTATION 1
+#endif
+
+// Internal helper: nanosecond timestamp
+inline long long sm_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Scheduling policy for a parallel_for call.
+//   steal  : work stealing (default). The range is split recursively down
+//            to `chunk` indices (chunk <= 0 picks about 8 leaves per thread)
+//            and idle pool workers steal halves from busy ones
+//   static : one contiguous sm_piece slice per thread
+//   dynamic: threads repeatedly take the next `chunk` indices from a shared
+//            atomic cursor (chunk <= 0 picks about 16 chunks per thread)
+//   guided : like dynamic, but each grab is remaining / (2 * threads),
+//            never smaller than `chunk` (min 1), so chunks shrink toward the end
+//   tiled  : 2D only. The space is cut into tile_i x tile_j rectangles
+//            (0 = sized from the L1/L2 caches) that are work-stolen as
+//            units and walked with plain nested loops. 1D calls treat it as steal.
+//   deterministic: the range is cut into `chunk` fixed sm_piece blocks (0 =
+//            one per SM_DETERMINISTIC_MIN_BLOCK indices, at most
+//            SM_DETERMINISTIC_BLOCKS), which depend only on the range, never
+//            on the thread count or timing. parallel_for gives each thread a
+//            contiguous run of blocks and walks them in order; parallel_reduce
+//            folds each block left to right and combines the block results in
+//            a fixed pairwise tree, so its result is bitwise reproducible.
+//   streaming: a hint for memory-bound loops. Static pieces, on at most
+//            sm_stream_threads() threads (the calibrated bandwidth knee),
+//            placed one per physical core when the pool is pinned.
+enum SM_ScheduleKind {
+    SM_SCHEDULE_STEAL, SM_SCHEDULE_STATIC, SM_SCHEDULE_DYNAMIC, SM_SCHEDULE_GUIDED, SM_SCHEDULE_TILED,
+    SM_SCHEDULE_DETERMINISTIC, SM_SCHEDULE_STREAMING
+};
+
+struct SM_Schedule {
+    SM_ScheduleKind kind;
+    int chunk;
+    int tile_i;
+    int tile_j;
+    SM_Schedule(SM_ScheduleKind k = SM_SCHEDULE_STEAL, int c = 0) : kind(k), chunk(c), tile_i(0), tile_j(0) {}
+};
+
+inline SM_Schedule sm_schedule_steal(int grain = 0) { return SM_Schedule(SM_SCHEDULE_STEAL, grain); }
+inline SM_Schedule sm_schedule_static() { return SM_Schedule(SM_SCHEDULE_STATIC); }
+inline SM_Schedule sm_schedule_dynamic(int chunk = 0) { return SM_Schedule(SM_SCHEDULE_DYNAMIC, chunk); }
+inline SM_Schedule sm_schedule_guided(int min_chunk = 1) { return SM_Schedule(SM_SCHEDULE_GUIDED, min_chunk); }
+inline SM_Schedule sm_schedule_tiled(int tile_i = 0, int tile_j = 0) {
+    SM_Schedule sched(SM_SCHEDULE_TILED);
+    sched.tile_i = tile_i;
+    sched.tile_j = tile_j;
+    return sched;
+}
+inline SM_Schedule sm_schedule_deterministic(int blocks = 0) {
+    return SM_Schedule(SM_SCHEDULE_DETERMINISTIC, blocks);
+}
+inline SM_Schedule sm_schedule_streaming() { return SM_Schedule(SM_SCHEDULE_STREAMING); }
+
+#ifndef SM_DETERMINISTIC_MIN_BLOCK
+#define SM_DETERMINISTIC_MIN_BLOCK 1024
+#endif
+#ifndef SM_DETERMINISTIC_BLOCKS
+#define SM_DETERMINISTIC_BLOCKS 1024
+#endif
+
+// Data cache size in bytes from sysconf, or fallback when the libc can't tell
+inline long sm_cache_bytes(int name, long fallback) {
+    long v = sysconf(name);
+    return v > 0 ? v : fallback;
+}
+
+// Automatic 2D tile shape: a tile row of tile_j int/float-sized elements is a
+// handful of cache lines (L1 / 512, ~64 columns for a 32 KB L1), and the tile
+// is tall enough that tile_i x tile_j x 64 bytes fills about half of L2, so
+// the column strip a matmul-style body streams stays cache-resident.
+inline void sm_auto_tile(int &tile_i, int &tile_j) {
+    static const long l1 = sm_cache_bytes(_SC_LEVEL1_DCACHE_SIZE, 32 * 1024);
+    static const long l2 = sm_cache_bytes(_SC_LEVEL2_CACHE_SIZE, 1024 * 1024);
+    long tj = std::min(512L, std::max(8L, l1 / 512));
+    long ti = std::min(512L, std::max(8L, l2 / (2 * 64 * tj)));
+    if (tile_j <= 0) tile_j = static_cast<int>(tj);
+    if (tile_i <= 0) tile_i = static_cast<int>(ti);
+}
+
+// Index type of the flat iteration spaces the schedulers split. The public
+// overloads accept any integral bounds (int, long long, size_t, ...) and call
+// the lambda with indices of that type; internally every range is 64-bit,
+// so a single call can cover more than INT_MAX elements.
+typedef long long SM_Index;
+
+// Index type of a public call: the common type of its bounds
+template<typename... Bounds>
+struct SM_IndexOf {
+    typedef typename std::common_type<Bounds...>::type type;
+    static_assert(std::is_integral<type>::value, "parallel_for bounds must be integers");
+};
+
+// Per-thread bump arena for per-call descriptors (pool task records, reduce
+// slots). Calls issued by one thread nest strictly, so allocation is a
+// stack: a call takes a mark, allocates, and rolls back to the mark when it
+// returns. Blocks are cache-line aligned and kept for reuse, so a thread
+// that has issued a call before allocates nothing for the next one.
+class SM_Arena {
+public:
+    struct Mark {
+        size_t block;
+        size_t used;
+    };
+
+    SM_Arena() : cur_(0) {}
+    ~SM_Arena() {
+        for (Block &b : blocks_) free(b.data);
+    }
+
+    // `bytes` of storage aligned to (and rounded up to) a cache line
+    void *alloc(size_t bytes) {
+        bytes = (bytes + SM_CACHE_LINE - 1) & ~static_cast<size_t>(SM_CACHE_LINE - 1);
+        while (cur_ < blocks_.size() && blocks_[cur_].size - blocks_[cur_].used < bytes) {
+            // blocks past the current one are unused; replace one that is too small
+            if (cur_ + 1 < blocks_.size() && blocks_[cur_ + 1].size < bytes) {
+                free(blocks_[cur_ + 1].data);
+                blocks_.erase(blocks_.begin() + static_cast<long>(cur_) + 1);
+            }
+            if (cur_ + 1 == blocks_.size()) break;
+            ++cur_;
+            blocks_[cur_].used = 0;
+        }
+        if (cur_ >= blocks_.size() || blocks_[cur_].size - blocks_[cur_].used < bytes) {
+            size_t size = std::max<size_t>(bytes, blocks_.empty() ? 16384 : 2 * blocks_.back().size);
+            Block b;
+            void *mem = nullptr;
+            if (posix_memalign(&mem, SM_CACHE_LINE, size) != 0) throw std::bad_alloc();
+            b.data = static_cast<char *>(mem);
+            b.size = size;
+            b.used = 0;
+            blocks_.push_back(b);
+            cur_ = blocks_.size() - 1;
+        }
+        Block &b = blocks_[cur_];
+        void *p = b.data + b.used;
+        b.used += bytes;
+        return p;
+    }
+
+    Mark mark() const {
+        Mark m = {cur_, cur_ < blocks_.size() ? blocks_[cur_].used : 0};
+        return m;
+    }
+
+    void release(const Mark &m) {
+        cur_ = m.block;
+        if (cur_ < blocks_.size()) blocks_[cur_].used = m.used;
+    }
+
+private:
+    struct Block {
+        char *data;
+        size_t size;
+        size_t used;
+    };
+
+    SM_Arena(const SM_Arena &) = delete;
+    SM_Arena &operator=(const SM_Arena &) = delete;
+
+    std::vector<Block> blocks_;
+    size_t cur_;
+};
+
+inline SM_Arena &sm_arena() {
+    static thread_local SM_Arena arena;
+    return arena;
+}
+
+// Rolls the calling thread's arena back when the call returns
+struct SM_ArenaScope {
+    SM_Arena &arena;
+    SM_Arena::Mark mark;
+    SM_ArenaScope() : arena(sm_arena()), mark(arena.mark()) {}
+    ~SM_ArenaScope() { arena.release(mark); }
+};
+
+// Priority of a call among concurrent ones: idle workers steal from the
+// highest-priority job in flight first, mailbox tasks are queued by it, and
+// concurrent stealing jobs share the workers in proportion to weights 1, 2
+// and 4
+enum SM_Priority { SM_PRIORITY_LOW, SM_PRIORITY_NORMAL, SM_PRIORITY_HIGH, SM_PRIORITY_LEVELS };
+
+// Settings that travel with a call: its priority and the most pool workers
+// it may use at once (-1: no limit beyond numThreads). Nested calls inherit
+// those of the call whose chunk issues them.
+struct SM_JobOptions {
+    SM_Priority priority;
+    int max_workers;
+    SM_JobOptions(SM_Priority p = SM_PRIORITY_NORMAL, int w = -1) : priority(p), max_workers(w) {}
+};
+
+inline const SM_JobOptions *&sm_job_scope() {
+    static thread_local const SM_JobOptions *scope = nullptr;
+    return scope;
+}
+
+// Every parallel call issued by this thread while the scope lives (and the
+// calls nested inside them) runs with these options, e.g. in a request
+// handler: SM_JobScope tenant(SM_PRIORITY_LOW, 2). Scopes nest.
+class SM_JobScope {
+public:
+    explicit SM_JobScope(SM_Priority priority, int max_workers = -1)
+        : options_(priority, max_workers), outer_(sm_job_scope()) {
+        sm_job_scope() = &options_;
+    }
+    ~SM_JobScope() { sm_job_scope() = outer_; }
+
+private:
+    SM_JobScope(const SM_JobScope &) = delete;
+    SM_JobScope &operator=(const SM_JobScope &) = delete;
+
+    SM_JobOptions options_;
+    const SM_JobOptions *outer_;
+};
+
+// Completion counter for one group of pool tasks (one parallel_for call)
+struct SM_TaskGroup {
+    std::atomic<int> pending;
+    SM_TaskGroup() : pending(0) {}
+};
+
+// One unit of mailbox work: run(task) executes it. The record belongs to
+// the submitter (arena, stack or its own allocation) and is linked into the
+// worker's mailbox intrusively, so posting it never allocates.
+struct SM_PoolTask {
+    void (*run)(SM_PoolTask *task);
+    SM_TaskGroup *group;
+    SM_PoolTask *next;
+    int priority;  // SM_Priority; set when posted
+};
+
+// Thread argument struct template: one contiguous piece of a chunk body.
+// The body lives on the issuing thread's stack, which outlives the piece.
+template<typename BodyType>
+struct alignas(SM_CACHE_LINE) SM_ThreadArg : SM_PoolTask {
+    BodyType *body;
+    SM_Index start_idx;
+    SM_Index end_idx;
+};
+
+// Bounds of piece t when [low, high) is cut into n contiguous pieces
+// (the first (high - low) % n pieces are one index longer)
+inline void sm_piece(SM_Index low, SM_Index high, int n, int t, SM_Index &b, SM_Index &e) {
+    SM_Index total = high - low;
+    SM_Index base = total / n;
+    SM_Index rem = total % n;
+    b = low + t * base + std::min<SM_Index>(t, rem);
+    e = b + base + (t < rem ? 1 : 0);
+}
+
+// Number of blocks of a deterministic split of n indices
+inline int sm_deterministic_blocks(SM_Index n, int requested) {
+    SM_Index blocks = requested > 0 ? requested
+                                    : std::min<SM_Index>(SM_DETERMINISTIC_BLOCKS, n / SM_DETERMINISTIC_MIN_BLOCK);
+    return static_cast<int>(std::max<SM_Index>(1, std::min(blocks, n)));
+}
+
+// Runs blocks [kb, ke) of the `blocks`-way sm_piece split of [low, high),
+// in order, each as one call of the inner body
+template<typename Body>
+struct SM_BlockBody {
+    Body &inner;
+    SM_Index low;
+    SM_Index high;
+    int blocks;
+    SM_BlockBody(Body &b, SM_Index l, SM_Index h, int n) : inner(b), low(l), high(h), blocks(n) {}
+    void operator()(SM_Index kb, SM_Index ke) {
+        for (SM_Index k = kb; k < ke; ++k) {
+            SM_Index b, e;
+            sm_piece(low, high, blocks, static_cast<int>(k), b, e);
+            inner(b, e);
+        }
+    }
+};
+
+// Chunk bodies: every parallel_for flavour is driven as body(begin, end)
+// over a slice of an index space; these adapt the user's lambda to that.
+// Bounds are taken by value so stores through the lambda never force a reload
+// of the trip count (which would block vectorization), and loops run in the
+// caller's index type so 32-bit spaces keep 32-bit induction variables.
+
+// 1D: one call per index
+template<typename F, typename I = int>
+struct SM_IndexBody {
+    F f;
+    explicit SM_IndexBody(F &&fn) : f(std::move(fn)) {}
+    explicit SM_IndexBody(const F &fn) : f(fn) {}
+    void operator()(SM_Index s, SM_Index e) {
+        I b = static_cast<I>(s);
+        I end = static_cast<I>(e);
+        for (I i = b; i < end; ++i) f(i);
+    }
+};
+
+// 1D range: the slice is handed over whole as f(begin, end)
+template<typename F, typename I>
+struct SM_RangeBody {
+    F f;
+    explicit SM_RangeBody(F &&fn) : f(std::move(fn)) {}
+    explicit SM_RangeBody(const F &fn) : f(fn) {}
+    void operator()(SM_Index s, SM_Index e) { f(static_cast<I>(s), static_cast<I>(e)); }
+};
+
+// 2D: the slice is a run of flat indices over a width2-wide row-major space.
+// One div/mod locates the first (i, j); after that the walk is row by row.
+template<typename F, typename I = int>
+struct SM_FlatBody2D {
+    F f;
+    I low1;
+    I low2;
+    SM_Index width2;
+    SM_FlatBody2D(F &&fn, I l1, I l2, SM_Index w) : f(std::move(fn)), low1(l1), low2(l2), width2(w) {}
+    SM_FlatBody2D(const F &fn, I l1, I l2, SM_Index w) : f(fn), low1(l1), low2(l2), width2(w) {}
+    void operator()(SM_Index s, SM_Index e) {
+        SM_Index w = width2;
+        I i = static_cast<I>(low1 + s / w);
+        SM_Index j0 = s % w;
+        SM_Index left = e - s;
+        while (left > 0) {
+            SM_Index n = std::min(w - j0, left);
+            I jb = static_cast<I>(low2 + j0);
+            I je = static_cast<I>(jb + n);
+            for (I j = jb; j < je; ++j) f(i, j);
+            left -= n;
+            j0 = 0;
+            ++i;
+        }
+    }
+};
+
+// Regular tiling of [low1, high1) x [low2, high2) into tile_i x tile_j
+// rectangles (edge tiles are smaller), numbered row-major
+template<typename I>
+struct SM_TileGrid {
+    I low1, high1, low2, high2;
+    SM_Index tile_i, tile_j;
+    SM_Index tiles_i, tiles_j;
+    SM_TileGrid(I l1, I h1, I l2, I h2, int ti, int tj)
+        : low1(l1), high1(h1), low2(l2), high2(h2), tile_i(ti), tile_j(tj),
+          tiles_i((static_cast<SM_Index>(h1) - l1 + ti - 1) / ti),
+          tiles_j((static_cast<SM_Index>(h2) - l2 + tj - 1) / tj) {}
+    SM_Index count() const { return tiles_i * tiles_j; }
+
+    // fn(i_begin, i_end, j_begin, j_end) for tiles [s, e)
+    template<typename Fn>
+    void for_tiles(SM_Index s, SM_Index e, Fn &fn) const {
+        SM_Index tr = s / tiles_j;
+        SM_Index tc = s % tiles_j;
+        SM_Index i0 = low1 + tr * tile_i;
+        SM_Index j0 = low2 + tc * tile_j;
+        for (SM_Index t = s; t < e; ++t) {
+            fn(static_cast<I>(i0), static_cast<I>(std::min<SM_Index>(i0 + tile_i, high1)),
+               static_cast<I>(j0), static_cast<I>(std::min<SM_Index>(j0 + tile_j, high2)));
+            j0 += tile_j;
+            if (++tc == tiles_j) {
+                tc = 0;
+                j0 = low2;
+                i0 += tile_i;
+            }
+        }
+    }
+};
+
+// 2D tiled: per-index lambda, each tile walked with nested loops (no div/mod)
+template<typename F, typename I = int>
+struct SM_TiledBody2D {
+    F f;
+    SM_TileGrid<I> grid;
+    SM_TiledBody2D(F &&fn, const SM_TileGrid<I> &g) : f(std::move(fn)), grid(g) {}
+    SM_TiledBody2D(const F &fn, const SM_TileGrid<I> &g) : f(fn), grid(g) {}
+    void operator()(I i0, I i1, I j0, I j1) {
+        for (I i = i0; i < i1; ++i)
+            for (I j = j0; j < j1; ++j) f(i, j);
+    }
+    void operator()(SM_Index s, SM_Index e) { grid.for_tiles(s, e, *this); }
+};
+
+// 2D range over a regular grid: each tile handed to f(i_begin, i_end, j_begin, j_end)
+template<typename F, typename I = int>
+struct SM_GridBody2D {
+    F f;
+    SM_TileGrid<I> grid;
+    SM_GridBody2D(F &&fn, const SM_TileGrid<I> &g) : f(std::move(fn)), grid(g) {}
+    SM_GridBody2D(const F &fn, const SM_TileGrid<I> &g) : f(fn), grid(g) {}
+    void operator()(SM_Index s, SM_Index e) { grid.for_tiles(s, e, f); }
+};
+
+// 2D range: the slice is a run of tile indices in a row_pieces x col_pieces
+// grid of sm_piece splits; each tile is handed over whole as
+// f(i_begin, i_end, j_begin, j_end)
+template<typename F, typename I = int>
+struct SM_TileBody2D {
+    F f;
+    I low1, high1, low2, high2;
+    int row_pieces, col_pieces;
+    SM_TileBody2D(F &&fn, I l1, I h1, int pr, I l2, I h2, int pc)
+        : f(std::move(fn)), low1(l1), high1(h1), low2(l2), high2(h2), row_pieces(pr), col_pieces(pc) {}
+    SM_TileBody2D(const F &fn, I l1, I h1, int pr, I l2, I h2, int pc)
+        : f(fn), low1(l1), high1(h1), low2(l2), high2(h2), row_pieces(pr), col_pieces(pc) {}
+    void operator()(SM_Index s, SM_Index e) {
+        for (SM_Index t = s; t < e; ++t) {
+            SM_Index ib, ie, jb, je;
+            sm_piece(low1, high1, row_pieces, static_cast<int>(t / col_pieces), ib, ie);
+            sm_piece(low2, high2, col_pieces, static_cast<int>(t % col_pieces), jb, je);
+            f(static_cast<I>(ib), static_cast<I>(ie), static_cast<I>(jb), static_cast<I>(je));
+        }
+    }
+};
+
+// Dynamic/guided: each thread's piece ignores its static slice and instead
+// claims chunks of [low, high) from the shared cursor until it runs dry
+template<typename BodyType>
+struct SM_ClaimBody {
+    BodyType &inner;
+    std::atomic<SM_Index> cursor;
+    SM_Index high;     // overshooting fetch_adds stay far below the 64-bit limit
+    SM_Index chunk;
+    int threads;
+    bool guided;
+    SM_ClaimBody(BodyType &b, SM_Index low, SM_Index h, int numThreads, const SM_Schedule &sched)
+        : inner(b), cursor(low), high(h), chunk(sched.chunk), threads(numThreads),
+          guided(sched.kind == SM_SCHEDULE_GUIDED) {
+        if (guided) chunk = std::max<SM_Index>(1, chunk);
+        else if (chunk <= 0) chunk = std::max<SM_Index>(1, (h - low) / (16LL * numThreads));
+    }
+    void operator()(SM_Index, SM_Index) {
+        BodyType &body = inner;
+        for (;;) {
+            SM_Index s, e;
+            if (!guided) {
+                s = cursor.fetch_add(chunk, std::memory_order_relaxed);
+                if (s >= high) return;
+                e = std::min(s + chunk, high);
+            } else {
+                s = cursor.load(std::memory_order_relaxed);
+                do {
+                    if (s >= high) return;
+                    SM_Index grab = std::max<SM_Index>(chunk, (high - s) / (2 * threads));
+                    e = std::min(s + grab, high);
+                } while (!cursor.compare_exchange_weak(s, e, std::memory_order_relaxed));
+            }
+            body(s, e);
+        }
+    }
+};
+
+// pool entry; templated on the body so the chunk loop inlines
+template<typename BodyType>
+void sm_thread_entry(SM_PoolTask *task) {
+    auto *arg = static_cast<SM_ThreadArg<BodyType>*>(task);
+    try {
+        (*arg->body)(arg->start_idx, arg->end_idx);
+    } catch (...) { /* bodies are wrapped in SM_GuardedBody; never reached */ }
+}
+
+// Upper bound on pool workers; deques live in a fixed table so thieves can
+// scan it while the pool grows
+#define SM_MAX_WORKERS 256
+// Deques for threads outside the pool that issue a work-stealing parallel_for
+#define SM_MAX_EXTERNAL 16
+// A thread waiting on a nested job only steals new work up to this depth
+#define SM_MAX_STEAL_DEPTH 8
+
+// How long (ns) a thread that runs out of work spins with pause before it
+// sleeps in the kernel: long enough that back-to-back fine-grained calls find
+// the workers still awake, short enough not to burn a core between phases.
+// 0 sleeps at once (the default on a single CPU, where spinning only delays
+// the thread being waited for). The SM_SPIN_NS environment variable
+// overrides the default, and sm_set_spin_ns() changes it at run time.
+#ifndef SM_SPIN_NS
+#define SM_SPIN_NS 100000
+#endif
+
+inline std::atomic<long long> &sm_spin_slot() {
+    static std::atomic<long long> ns([] {
+        const char *env = getenv("SM_SPIN_NS");
+        if (env) return std::max(0LL, atoll(env));
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        int cpus = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : sysconf(_SC_NPROCESSORS_ONLN);
+        return cpus > 1 ? static_cast<long long>(SM_SPIN_NS) : 0LL;
+    }());
+    return ns;
+}
+
+inline long long sm_spin_ns() { return sm_spin_slot().load(std::memory_order_relaxed); }
+inline void sm_set_spin_ns(long long ns) { sm_spin_slot().store(std::max(0LL, ns), std::memory_order_relaxed); }
+
+// Spin-loop hint: lets the sibling hyperthread run and saves power
+inline void sm_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+// Spin with pause until done() holds or the spin budget runs out; returns
+// done() at exit. The clock is read once per 64 pauses.
+template<typename Pred>
+bool sm_spin_until(Pred done) {
+    long long budget = sm_spin_ns();
+    if (budget <= 0) return done();
+    long long start = sm_now_ns();
+    for (unsigned k = 1;; ++k) {
+        if (done()) return true;
+        sm_cpu_relax();
+        if (k % 64 == 0 && sm_now_ns() - start >= budget) return done();
+    }
+}
+
+static_assert(sizeof(std::atomic<unsigned>) == sizeof(unsigned), "futex words must be plain 32-bit");
+
+// Sleep while word == expected, until woken or (timeout_ns >= 0) the
+// timeout passes. Spurious returns are possible: callers re-check.
+inline void sm_futex_wait(std::atomic<unsigned> &word, unsigned expected, long long timeout_ns = -1) {
+    timespec ts;
+    timespec *tp = nullptr;
+    if (timeout_ns >= 0) {
+        ts.tv_sec = static_cast<time_t>(timeout_ns / 1000000000LL);
+        ts.tv_nsec = static_cast<long>(timeout_ns % 1000000000LL);
+        tp = &ts;
+    }
+    syscall(SYS_futex, reinterpret_cast<unsigned *>(&word), FUTEX_WAIT_PRIVATE, expected, tp, nullptr, 0);
+}
+
+// Wake up to n threads sleeping on word
+inline void sm_futex_wake(std::atomic<unsigned> &word, int n = INT_MAX) {
+    syscall(SYS_futex, reinterpret_cast<unsigned *>(&word), FUTEX_WAKE_PRIVATE, n, nullptr, nullptr, 0);
+}
+
+// Sense-reversing barrier for a fixed number of threads, reusable from one
+// phase to the next: arrivals count down, the last one resets the count and
+// flips the sense, and the others spin (then futex-wait) for the flip.
+// A thread that arrives for the next phase before everyone has left this one
+// sees the new sense and waits for the next flip, so no phase can be missed.
+class SM_Barrier {
+public:
+    explicit SM_Barrier(int threads) : threads_(threads), count_(threads), sense_(0), sleepers_(0) {
+        if (threads < 1) throw std::invalid_argument("SM_Barrier needs at least one thread");
+    }
+
+    // Blocks until all threads have arrived; true on exactly one of them
+    bool arrive_and_wait() {
+        unsigned sense = sense_.load(std::memory_order_acquire);
+        if (count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            count_.store(threads_, std::memory_order_relaxed);
+            sense_.store(sense ^ 1u);
+            if (sleepers_.load() > 0) sm_futex_wake(sense_);
+            return true;
+        }
+        if (sm_spin_until([&] { return sense_.load(std::memory_order_acquire) != sense; })) return false;
+        sleepers_.fetch_add(1);
+        while (sense_.load() == sense) sm_futex_wait(sense_, sense);
+        sleepers_.fetch_sub(1);
+        return false;
+    }
+
+    int threads() const { return threads_; }
+
+private:
+    SM_Barrier(const SM_Barrier &) = delete;
+    SM_Barrier &operator=(const SM_Barrier &) = delete;
+
+    const int threads_;
+    std::atomic<int> count_;
+    std::atomic<unsigned> sense_;
+    std::atomic<int> sleepers_;
+};
+
+// Type-erased work-stealing job: run(job, b, e) executes [b, e) of the body.
+// Lives on the issuing thread's stack; `remaining` reaching zero is the only
+// signal that every index has run, after which nobody touches the job.
+struct SM_WsJob {
+    void (*run)(SM_WsJob *job, SM_Index begin, SM_Index end);
+    std::atomic<SM_Index> remaining;
+    SM_Index grain;
+    SM_WsJob(void (*r)(SM_WsJob *, SM_Index, SM_Index), SM_Index n, SM_Index g) : run(r), remaining(n), grain(g) {}
+};
+
+template<typename BodyType>
+struct SM_WsJobFor : SM_WsJob {
+    BodyType *body;
+    SM_WsJobFor(BodyType *b, SM_Index n, SM_Index g) : SM_WsJob(&SM_WsJobFor::run_range, n, g), body(b) {}
+    static void run_range(SM_WsJob *job, SM_Index begin, SM_Index end) {
+        (*static_cast<SM_WsJobFor *>(job)->body)(begin, end);
+    }
+};
+
+// A stealable piece of a job. `limit` is the job's thread count: only the
+// limit - 1 pool workers from index `first` on (and threads outside the
+// pool) may take it. `priority` ranks it for thieves.
+struct SM_WsRange {
+    SM_WsJob *job;
+    SM_Index begin;
+    SM_Index end;
+    int limit;
+    int first;
+    int priority;
+};
+
+// Chase-Lev work-stealing deque over a fixed ring of range slots. The owner
+// pushes/pops at the bottom, thieves CAS the top. Slots are plain atomics, so
+// ranges are stored by value and no task is ever heap-allocated; a full deque
+// simply makes the owner run the range without splitting it further.
+class SM_WsDeque {
+public:
+    static const int kCapacity = 256;
+
+    SM_WsDeque() : top_(0), bottom_(0) {}
+
+    bool push(const SM_WsRange &r) {
+        long long b = bottom_.load(std::memory_order_relaxed);
+        long long t = top_.load(std::memory_order_acquire);
+        if (b - t >= kCapacity) return false;
+        Slot &s = slots_[b & (kCapacity - 1)];
+        s.job.store(r.job, std::memory_order_relaxed);
+        s.begin.store(r.begin, std::memory_order_relaxed);
+        s.end.store(r.end, std::memory_order_relaxed);
+        s.limit.store(r.limit, std::memory_order_relaxed);
+        s.first.store(r.first, std::memory_order_relaxed);
+        s.priority.store(r.priority, std::memory_order_relaxed);
+        bottom_.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(SM_WsRange &r) {
+        long long b = bottom_.load(std::memory_order_relaxed) - 1;
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long t = top_.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        read(b, r);
+        if (t == b) {
+            // last item: race the thieves for it
+            bool won = top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                    std::memory_order_relaxed);
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // thief is the stealing worker's index, or -1 for a thread outside the
+    // pool; ranges below min_priority are left alone
+    bool steal(SM_WsRange &r, int thief, int min_priority = SM_PRIORITY_LOW) {
+        long long t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long b = bottom_.load(std::memory_order_acquire);
+        if (t >= b) return false;
+        read(t, r);
+        if (thief >= 0 && (thief < r.first || thief >= r.first + r.limit - 1)) return false;
+        if (r.priority < min_priority) return false;
+        return top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                            std::memory_order_relaxed);
+    }
+
+private:
+    struct Slot {
+        std::atomic<SM_WsJob *> job;
+        std::atomic<SM_Index> begin;
+        std::atomic<SM_Index> end;
+        std::atomic<int> limit;
+        std::atomic<int> first;
+        std::atomic<int> priority;
+    };
+
+    void read(long long idx, SM_WsRange &r) const {
+        const Slot &s = slots_[idx & (kCapacity - 1)];
+        r.job = s.job.load(std::memory_order_relaxed);
+        r.begin = s.begin.load(std::memory_order_relaxed);
+        r.end = s.end.load(std::memory_order_relaxed);
+        r.limit = s.limit.load(std::memory_order_relaxed);
+        r.first = s.first.load(std::memory_order_relaxed);
+        r.priority = s.priority.load(std::memory_order_relaxed);
+    }
+
+    // top and bottom on separate cache lines: thieves hammer one, the owner the other
+    std::atomic<long long> top_;
+    char pad_top_[SM_CACHE_LINE - sizeof(std::atomic<long long>)];
+    std::atomic<long long> bottom_;
+    char pad_bottom_[SM_CACHE_LINE - sizeof(std::atomic<long long>)];
+    Slot slots_[kCapacity];
+};
+
+// Independent tasks (SM_TaskSet, parallel_invoke) share one pool-wide ring
+// of this many slots (a power of two); a submit that finds it full runs the
+// task on the submitting thread instead
+#ifndef SM_TASK_QUEUE_SLOTS
+#define SM_TASK_QUEUE_SLOTS 1024
+#endif
+// Callables up to this many bytes (16-byte aligned at most, nothrow
+// movable) are stored in the ring slot; larger ones are boxed on the heap
+#ifndef SM_TASK_INLINE_BYTES
+#define SM_TASK_INLINE_BYTES 64
+#endif
+
+// op(SM_TASK_RUN, storage, owner) runs the callable in storage, destroys it
+// and reports to its owner; op(SM_TASK_MOVE, storage, to) moves it to `to`
+// and destroys the source
+enum SM_TaskOpKind { SM_TASK_RUN, SM_TASK_MOVE };
+typedef void (*SM_TaskOp)(SM_TaskOpKind kind, void *storage, void *arg);
+
+struct SM_QueuedTask {
+    SM_TaskOp op;
+    void *owner;
+    alignas(16) unsigned char storage[SM_TASK_INLINE_BYTES];
+    void run() { op(SM_TASK_RUN, storage, owner); }
+};
+
+// Bounded lock-free MPMC ring (Vyukov). Each slot's sequence number says
+// whether it is free for the producer at position pos (seq == pos) or holds
+// the task for the consumer at pos (seq == pos + 1); producers and
+// consumers claim positions with a CAS on their own cursor. Tasks are
+// constructed in their slot, and a consumer moves its task to the stack
+// before running it, so the slot is free again at once.
+class SM_TaskQueue {
+public:
+    SM_TaskQueue() : head_(0), tail_(0) {
+        for (size_t i = 0; i < kSlots; ++i) slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // construct(storage) builds the callable in the claimed slot and must not
+    // throw (the slot would never be published); false when full
+    template<typename Construct>
+    bool push(SM_TaskOp op, void *owner, Construct &construct) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot &s = slots_[pos & (kSlots - 1)];
+            size_t seq = s.seq.load(std::memory_order_acquire);
+            std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq - pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    s.task.op = op;
+                    s.task.owner = owner;
+                    construct(static_cast<void *>(s.task.storage));
+                    s.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(SM_QueuedTask &out) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot &s = slots_[pos & (kSlots - 1)];
+            size_t seq = s.seq.load(std::memory_order_acquire);
+            std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq - (pos + 1));
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    out.op = s.task.op;
+                    out.owner = s.task.owner;
+                    out.op(SM_TASK_MOVE, s.task.storage, out.storage);
+                    s.seq.store(pos + kSlots, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // may report a task whose producer has not finished publishing it
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    static const size_t kSlots = SM_TASK_QUEUE_SLOTS;
+    static_assert((kSlots & (kSlots - 1)) == 0, "SM_TASK_QUEUE_SLOTS must be a power of two");
+
+    struct alignas(SM_CACHE_LINE) Slot {
+        std::atomic<size_t> seq;
+        SM_QueuedTask task;
+    };
+
+    // the cursors on separate cache lines: producers hammer one, consumers the other
+    std::atomic<size_t> head_;
+    char pad_head_[SM_CACHE_LINE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail_;
+    char pad_tail_[SM_CACHE_LINE - sizeof(std::atomic<size_t>)];
+    Slot slots_[kSlots];
+};
+
+// Per-thread scheduler state: the deque this thread pushes to (its worker
+// deque, or a borrowed external one), its worker index (-1 outside the pool)
+// and how many jobs it is currently waiting on.
+struct SM_WsContext {
+    SM_WsDeque *deque;
+    int index;
+    int depth;
+    int external_slot;
+    unsigned rng;
+};
+
+inline SM_WsContext &sm_ws_context() {
+    static thread_local SM_WsContext ctx = {nullptr, -1, 0, -1, 0x9e3779b9u};
+    return ctx;
+}
+
+// Index of the running thread in a per-call array of `count` slots laid out
+// as [issuing thread, worker 0, worker 1, ...]; returns count for any other
+// thread (a worker started after the call began, or another caller helping)
+inline int sm_thread_slot(const SM_WsContext *issuer, int count) {
+    const SM_WsContext &ctx = sm_ws_context();
+    if (&ctx == issuer) return 0;
+    return (ctx.index >= 0 && ctx.index + 1 < count) ? ctx.index + 1 : count;
+}
+
+// ---------------------------------------------------------------------------
+// CPU affinity
+// ---------------------------------------------------------------------------
+
+//   none    : leave placement to the OS (default)
+//   compact : fill one socket before the next, SMT siblings adjacent
+//   scatter : round-robin over sockets, one hardware thread per core before
+//             any SMT sibling
+//   explicit: the caller's CPU list, in order
+enum SM_AffinityKind { SM_AFFINITY_NONE, SM_AFFINITY_COMPACT, SM_AFFINITY_SCATTER, SM_AFFINITY_EXPLICIT };
+
+struct SM_Affinity {
+    SM_AffinityKind kind;
+    std::vector<int> cpus;   // SM_AFFINITY_EXPLICIT only
+    bool pin_caller;         // also pin the thread calling sm_set_affinity to the first CPU
+    SM_Affinity(SM_AffinityKind k = SM_AFFINITY_NONE) : kind(k), pin_caller(true) {}
+};
+
+inline SM_Affinity sm_affinity_compact() { return SM_Affinity(SM_AFFINITY_COMPACT); }
+inline SM_Affinity sm_affinity_scatter() { return SM_Affinity(SM_AFFINITY_SCATTER); }
+inline SM_Affinity sm_affinity_cpus(const std::vector<int> &cpus) {
+    SM_Affinity a(SM_AFFINITY_EXPLICIT);
+    a.cpus = cpus;
+    return a;
+}
+
+inline int sm_read_sysfs_int(const char *fmt, int cpu, int fallback) {
+    char path[128];
+    snprintf(path, sizeof(path), fmt, cpu);
+    FILE *f = fopen(path, "r");
+    if (!f) return fallback;
+    int v = fallback;
+    if (fscanf(f, "%d", &v) != 1) v = fallback;
+    fclose(f);
+    return v;
+}
+
+// Allowed CPUs of this process ordered for the given policy. Sockets
+// (physical_package_id) stand in for NUMA nodes; without sysfs topology the
+// order is plain CPU numbering.
+inline std::vector<int> sm_cpu_order(const SM_Affinity &aff) {
+    if (aff.kind == SM_AFFINITY_EXPLICIT) return aff.cpus;
+    std::vector<int> order;
+    if (aff.kind == SM_AFFINITY_NONE) return order;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return order;
+
+    struct Cpu { int id, package, core, smt; };
+    std::vector<Cpu> cpus;
+    for (int c = 0; c < CPU_SETSIZE; ++c) {
+        if (!CPU_ISSET(c, &allowed)) continue;
+        Cpu x;
+        x.id = c;
+        x.package = sm_read_sysfs_int("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", c, 0);
+        x.core = sm_read_sysfs_int("/sys/devices/system/cpu/cpu%d/topology/core_id", c, c);
+        x.smt = 0;
+        for (const Cpu &y : cpus)
+            if (y.package == x.package && y.core == x.core) ++x.smt;
+        cpus.push_back(x);
+    }
+    if (aff.kind == SM_AFFINITY_COMPACT) {
+        std::stable_sort(cpus.begin(), cpus.end(), [](const Cpu &a, const Cpu &b) {
+            if (a.package != b.package) return a.package < b.package;
+            return a.core < b.core;
+        });
+    } else {
+        // rank each CPU within its socket (first threads of all cores, then
+        // their siblings), then interleave sockets by that rank
+        std::stable_sort(cpus.begin(), cpus.end(), [](const Cpu &a, const Cpu &b) {
+            if (a.package != b.package) return a.package < b.package;
+            if (a.smt != b.smt) return a.smt < b.smt;
+            return a.core < b.core;
+        });
+        std::vector<std::pair<std::pair<int,int>, int>> keyed; // ((rank, package), cpu)
+        int rank = 0;
+        for (size_t k = 0; k < cpus.size(); ++k) {
+            rank = (k > 0 && cpus[k].package == cpus[k - 1].package) ? rank + 1 : 0;
+            keyed.push_back(std::make_pair(std::make_pair(rank, cpus[k].package), cpus[k].id));
+        }
+        std::sort(keyed.begin(), keyed.end());
+        for (size_t k = 0; k < keyed.size(); ++k) order.push_back(keyed[k].second);
+        return order;
+    }
+    for (const Cpu &x : cpus) order.push_back(x.id);
+    return order;
+}
+
+// CPUs this process may run on (its affinity mask), at least 1
+inline int sm_cpu_count() {
+    static const int count = [] {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) return CPU_COUNT(&set);
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n > 0 ? static_cast<int>(n) : 1;
+    }();
+    return count;
+}
+
+// Physical core of a CPU as (package << 20) | core_id, from sysfs topology
+// (without it every CPU is its own core)
+inline long sm_cpu_core(int cpu) {
+    long package = sm_read_sysfs_int("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu, 0);
+    return (package << 20) | sm_read_sysfs_int("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu, cpu);
+}
+
+// Physical cores among the CPUs this process may run on, at least 1
+inline int sm_physical_cores() {
+    static const int count = [] {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) != 0) return sm_cpu_count();
+        std::vector<long> cores;
+        for (int c = 0; c < CPU_SETSIZE; ++c)
+            if (CPU_ISSET(c, &set)) cores.push_back(sm_cpu_core(c));
+        std::sort(cores.begin(), cores.end());
+        int n = static_cast<int>(std::unique(cores.begin(), cores.end()) - cores.begin());
+        return std::max(1, n);
+    }();
+    return count;
+}
+
+inline void sm_pin_thread(pthread_t tid, int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(tid, sizeof(set), &set); // best effort
+}
+
+// Process-wide pool of long-lived pthreads, started lazily on first use and
+// joined at process exit. Three kinds of work reach the workers:
+//   - (entry, arg) tasks posted to a specific worker's mailbox, used by the
+//     static/dynamic schedules: piece t of a call always runs on worker t,
+//     so data first-touched by piece t stays local to that worker's CPU;
+//   - ranges in per-worker Chase-Lev deques, used by the work-stealing
+//     schedule. Ranges are split recursively and idle workers steal halves;
+//   - independent tasks in the shared SM_TaskQueue, taken by any worker.
+// A thread that runs out of work spins (sm_spin_ns) and then sleeps on a
+// futex: idle workers on epoch_, threads waiting for a call on done_seq_.
+// Producers only make the wake-up system call when someone is asleep.
+class SM_ThreadPool {
+public:
+    static SM_ThreadPool &instance() {
+        static SM_ThreadPool pool;
+        return pool;
+    }
+
+    // grow the pool to at least n workers (never shrinks, capped at SM_MAX_WORKERS)
+    void ensure_workers(int n) {
+        n = std::min(n, SM_MAX_WORKERS);
+        if (worker_count_.load(std::memory_order_acquire) >= n) return;
+        pthread_mutex_lock(&mtx_);
+        while (worker_count_.load(std::memory_order_relaxed) < n && !stopping_.load()) {
+            int index = worker_count_.load(std::memory_order_relaxed);
+            Worker *w = new Worker();
+            WorkerStart *start = new WorkerStart{this, index, w};
+            if (pthread_create(&w->tid, nullptr, &SM_ThreadPool::worker_main, start) != 0) {
+                delete start;
+                delete w;
+                pthread_mutex_unlock(&mtx_);
+                throw std::runtime_error("pthread_create failed (pool)");
+            }
+            if (!cpu_order_.empty()) sm_pin_thread(w->tid, cpu_for(index));
+            workers_[index].store(w, std::memory_order_release);
+            worker_count_.store(index + 1, std::memory_order_release);
+        }
+        pthread_mutex_unlock(&mtx_);
+    }
+
+    // Pin workers per the policy: the first CPU of the order belongs to the
+    // caller (it runs the last static piece), worker w gets CPU w + 1 (mod
+    // the list). Applies to existing workers and every worker started later.
+    void set_affinity(const SM_Affinity &aff) {
+        std::vector<int> order = sm_cpu_order(aff);
+        std::vector<int> spread = core_spread(order);
+        pthread_mutex_lock(&mtx_);
+        cpu_order_ = order;
+        for (size_t k = 0; k < spread.size(); ++k)
+            core_workers_[k].store(spread[k], std::memory_order_relaxed);
+        core_worker_count_.store(static_cast<int>(spread.size()), std::memory_order_release);
+        int n = worker_count_.load(std::memory_order_relaxed);
+        for (int i = 0; i < n; ++i) {
+            Worker *w = workers_[i].load(std::memory_order_relaxed);
+            if (!order.empty()) {
+                sm_pin_thread(w->tid, cpu_for(i));
+            } else {
+                cpu_set_t all;
+                CPU_ZERO(&all);
+                if (sched_getaffinity(0, sizeof(all), &all) == 0)
+                    pthread_setaffinity_np(w->tid, sizeof(all), &all);
+            }
+        }
+        pthread_mutex_unlock(&mtx_);
+        if (!order.empty() && aff.pin_caller) sm_pin_thread(pthread_self(), order[0]);
+    }
+
+    // current number of workers (only grows)
+    int size() const { return worker_count_.load(std::memory_order_acquire); }
+
+    // Worker for piece t of a streaming call. Once the pool is pinned, the
+    // first pieces go to workers on physical cores distinct from each other
+    // and from the caller's; unpinned (or past those), worker indices are
+    // handed out in order after them.
+    int core_worker(int t) const {
+        int n = core_worker_count_.load(std::memory_order_acquire);
+        if (n == 0) return t;
+        if (t < n) return core_workers_[t].load(std::memory_order_relaxed);
+        return core_workers_[n - 1].load(std::memory_order_relaxed) + 1 + (t - n);
+    }
+
+    // Post a task to worker `worker`'s mailbox; call flush() once the batch
+    // is posted to wake the recipients.
+    void submit(int worker, SM_PoolTask *task, SM_TaskGroup &group, SM_Priority prio = SM_PRIORITY_NORMAL) {
+        group.pending.fetch_add(1, std::memory_order_relaxed);
+        task->group = &group;
+        task->priority = prio;
+        enqueue(worker, task);
+    }
+
+    // Post a task outside any group; it reports its own completion with
+    // complete() (for tasks whose group may not outlive their record)
+    void post(int worker, SM_PoolTask *task, SM_Priority prio = SM_PRIORITY_NORMAL) {
+        task->group = nullptr;
+        task->priority = prio;
+        enqueue(worker, task);
+    }
+
+    // Queue an independent task for any thread to run (see SM_TaskQueue);
+    // false when the queue is full
+    template<typename Construct>
+    bool push_task(SM_TaskOp op, void *owner, Construct construct) {
+        if (!tasks_.push(op, owner, construct)) return false;
+        notify_work(false);
+        notify_done(); // threads waiting for a task set help run the queue
+        return true;
+    }
+
+    // Run one queued task, if any
+    bool run_task() {
+        SM_QueuedTask t;
+        if (!tasks_.pop(t)) return false;
+        t.run();
+        return true;
+    }
+
+    // One task of the group has finished
+    void complete(SM_TaskGroup &group) {
+        if (group.pending.fetch_sub(1, std::memory_order_acq_rel) == 1) notify_done();
+    }
+
+    void flush() {
+        notify_work(true);
+        notify_done(); // recipients blocked in a nested wait must see their mail
+    }
+
+    // Block until every task of the group has run, or until deadline_ns on
+    // the sm_now_ns() clock (negative: no deadline); false on timeout. A
+    // worker waiting here keeps serving its own mailbox (and its deque), so a
+    // parallel_for issued from inside a worker cannot deadlock the pool.
+    bool wait(SM_TaskGroup &group, long long deadline_ns = -1) {
+        SM_WsContext &ctx = sm_ws_context();
+        Worker *self = ctx.index >= 0 ? workers_[ctx.index].load(std::memory_order_relaxed) : nullptr;
+        while (group.pending.load(std::memory_order_acquire) > 0) {
+            if (deadline_ns >= 0 && sm_now_ns() >= deadline_ns) return false;
+            SM_WsRange r;
+            if (SM_PoolTask *t = self ? take_mail(self) : nullptr) {
+                run(t);
+                continue;
+            }
+            if (self && ctx.deque->pop(r)) {
+                execute(ctx, r, false);
+                continue;
+            }
+            if (run_task()) continue;
+            // nothing to run here: spin for the group (or new mail or tasks),
+            // then sleep; timed waits skip the spin so a short timeout returns on time
+            auto ready = [&] {
+                return group.pending.load() == 0 || (self && self->mail_count.load() > 0) || !tasks_.empty();
+            };
+            if (deadline_ns < 0 && sm_spin_until(ready)) continue;
+            waiters_.fetch_add(1);
+            unsigned seq = done_seq_.load(std::memory_order_acquire);
+            if (!ready()) {
+                long long left = deadline_ns - sm_now_ns();
+                if (deadline_ns < 0) sm_futex_wait(done_seq_, seq);
+                else if (left > 0) sm_futex_wait(done_seq_, seq, left);
+            }
+            waiters_.fetch_sub(1);
+        }
+        return true;
+    }
+
+    // Work-stealing execution of job over [low, high) with at most
+    // numThreads threads. The caller splits the range into its deque, runs
+    // the leftmost leaf and then keeps popping/stealing until the job drains.
+    // Nested calls from inside a body reuse the worker's own deque, so they
+    // add work to the existing threads rather than creating more.
+    void run_stealing(SM_WsJob &job, SM_Index low, SM_Index high, int numThreads,
+                      SM_Priority prio = SM_PRIORITY_NORMAL) {
+        ensure_workers(numThreads - 1);
+        Admission seat(*this, numThreads - 1, prio);
+        SM_WsContext &ctx = sm_ws_context();
+        bool borrowed = false;
+        if (!ctx.deque) {
+            if (!acquire_external(ctx)) {
+                // every external deque is in use: run it here, unsplit
+                job.run(&job, low, high);
+                return;
+            }
+            borrowed = true;
+        }
+        ++ctx.depth;
+        SM_WsRange root = {&job, low, high, seat.workers + 1, seat.first, prio};
+        execute(ctx, root, true);
+        wait_job(ctx, job);
+        --ctx.depth;
+        if (borrowed) {
+            // while waiting we may have stolen (and split) other jobs' ranges;
+            // finish them before the deque stops being visible to thieves
+            SM_WsRange r;
+            while (ctx.deque->pop(r)) execute(ctx, r, false);
+            release_external(ctx);
+        }
+    }
+
+private:
+    struct Worker {
+        SM_WsDeque deque;
+        pthread_mutex_t mail_mtx;       // per worker: posts to different workers never contend
+        SM_PoolTask *mail_head;         // FIFO mailbox, guarded by mail_mtx
+        SM_PoolTask *mail_tail;
+        std::atomic<int> mail_count;
+        pthread_t tid;
+        Worker() : mail_head(nullptr), mail_tail(nullptr), mail_count(0) { pthread_mutex_init(&mail_mtx, nullptr); }
+        ~Worker() { pthread_mutex_destroy(&mail_mtx); }
+    };
+
+    struct WorkerStart {
+        SM_ThreadPool *pool;
+        int index;
+        Worker *worker;
+    };
+
+    // Share of the workers for one stealing job while it runs. The pool's
+    // size() + 1 threads (workers plus, nominally, one caller) are divided
+    // among the jobs in flight by priority weight; a job keeps one seat for
+    // its caller and may use up to `want` workers of the rest, so concurrent
+    // callers together stay near one runnable thread per worker. A job
+    // running alone gets workers [0, want) as before; concurrent ones take
+    // rotating windows so they mostly steal from different workers.
+    struct Admission {
+        SM_ThreadPool &pool;
+        SM_Priority prio;
+        int first;
+        int workers;
+        Admission(SM_ThreadPool &p, int want, SM_Priority pr) : pool(p), prio(pr), first(0), workers(0) {
+            int weight = 1 << prio;
+            int total = weight;
+            int jobs = 1;
+            for (int k = 0; k < SM_PRIORITY_LEVELS; ++k) {
+                int n = pool.active_[k].load(std::memory_order_relaxed);
+                total += n << k;
+                jobs += n;
+            }
+            pool.active_[prio].fetch_add(1, std::memory_order_relaxed);
+            int size = pool.size();
+            int share = std::max(1, static_cast<int>(static_cast<long long>(size + 1) * weight / total));
+            workers = std::max(0, std::min(want, std::min(size, share - 1)));
+            if (jobs > 1 && workers > 0)
+                first = static_cast<int>(pool.window_.fetch_add(workers, std::memory_order_relaxed) %
+                                         static_cast<unsigned>(size - workers + 1));
+        }
+        ~Admission() { pool.active_[prio].fetch_sub(1, std::memory_order_relaxed); }
+    };
+
+    // Highest priority with a stealing job in flight
+    int top_priority() const {
+        for (int k = SM_PRIORITY_LEVELS - 1; k > SM_PRIORITY_LOW; --k)
+            if (active_[k].load(std::memory_order_relaxed) > 0) return k;
+        return SM_PRIORITY_LOW;
+    }
+
+    SM_ThreadPool()
+        : stopping_(false), waiters_(0), worker_count_(0), sleepers_(0), epoch_(0), done_seq_(0),
+          window_(0), core_worker_count_(0), external_used_(0) {
+        pthread_mutex_init(&mtx_, nullptr);
+        for (int k = 0; k < SM_PRIORITY_LEVELS; ++k) active_[k].store(0, std::memory_order_relaxed);
+        for (int i = 0; i < SM_MAX_WORKERS; ++i) workers_[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    int cpu_for(int index) const {
+        return cpu_order_[(index + 1) % cpu_order_.size()];
+    }
+
+    // Ascending worker indices whose CPUs under `order` (see cpu_for) sit on
+    // distinct physical cores, none shared with the caller's CPU order[0]
+    static std::vector<int> core_spread(const std::vector<int> &order) {
+        std::vector<int> spread;
+        if (order.empty()) return spread;
+        std::vector<long> used(1, sm_cpu_core(order[0]));
+        int n = std::min(static_cast<int>(order.size()) - 1, SM_MAX_WORKERS);
+        for (int w = 0; w < n; ++w) {
+            long core = sm_cpu_core(order[w + 1]);
+            if (std::find(used.begin(), used.end(), core) != used.end()) continue;
+            used.push_back(core);
+            spread.push_back(w);
+        }
+        return spread;
+    }
+
+    ~SM_ThreadPool() {
+        stopping_.store(true);
+        epoch_.fetch_add(1);
+        sm_futex_wake(epoch_);
+        int n = worker_count_.load();
+        for (int i = 0; i < n; ++i) pthread_join(workers_[i].load()->tid, nullptr);
+        for (int i = 0; i < n; ++i) delete workers_[i].load();
+        pthread_mutex_destroy(&mtx_);
+    }
+
+    SM_ThreadPool(const SM_ThreadPool &) = delete;
+    SM_ThreadPool &operator=(const SM_ThreadPool &) = delete;
+
+    // Mailboxes are FIFO within a priority; a task goes behind every task of
+    // its priority or higher
+    void enqueue(int worker, SM_PoolTask *task) {
+        Worker *w = workers_[worker % size()].load(std::memory_order_acquire);
+        task->next = nullptr;
+        pthread_mutex_lock(&w->mail_mtx);
+        if (!w->mail_tail || w->mail_tail->priority >= task->priority) {
+            if (w->mail_tail) w->mail_tail->next = task;
+            else w->mail_head = task;
+            w->mail_tail = task;
+        } else if (w->mail_head->priority < task->priority) {
+            task->next = w->mail_head;
+            w->mail_head = task;
+        } else {
+            SM_PoolTask *at = w->mail_head;
+            while (at->next->priority >= task->priority) at = at->next;
+            task->next = at->next;
+            at->next = task;
+        }
+        w->mail_count.fetch_add(1, std::memory_order_relaxed);
+        pthread_mutex_unlock(&w->mail_mtx);
+    }
+
+    SM_PoolTask *take_mail(Worker *w) {
+        if (w->mail_count.load(std::memory_order_relaxed) == 0) return nullptr;
+        pthread_mutex_lock(&w->mail_mtx);
+        SM_PoolTask *t = w->mail_head;
+        if (t) {
+            w->mail_head = t->next;
+            if (!w->mail_head) w->mail_tail = nullptr;
+            w->mail_count.fetch_sub(1, std::memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&w->mail_mtx);
+        return t;
+    }
+
+    void run(SM_PoolTask *t) {
+        // the record may be gone once run returns; only the group outlives it
+        SM_TaskGroup *group = t->group;
+        t->run(t);
+        if (group) complete(*group);
+    }
+
+    // Wake parked workers after publishing work. The seq_cst fence pairs with
+    // the one in worker_main's sleep path: either the producer sees the
+    // sleeper, or the sleeper's final scan sees the work.
+    void notify_work(bool all) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_relaxed) == 0) return;
+        epoch_.fetch_add(1, std::memory_order_release);
+        sm_futex_wake(epoch_, all ? INT_MAX : 1);
+    }
+
+    void notify_done() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_relaxed) == 0) return;
+        done_seq_.fetch_add(1, std::memory_order_release);
+        sm_futex_wake(done_seq_);
+    }
+
+    bool acquire_external(SM_WsContext &ctx) {
+        unsigned used = external_used_.load();
+        for (int i = 0; i < SM_MAX_EXTERNAL; ++i) {
+            unsigned bit = 1u << i;
+            while (!(used & bit)) {
+                if (external_used_.compare_exchange_weak(used, used | bit)) {
+                    ctx.deque = &external_[i];
+                    ctx.external_slot = i;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void release_external(SM_WsContext &ctx) {
+        external_used_.fetch_and(~(1u << ctx.external_slot));
+        ctx.deque = nullptr;
+        ctx.external_slot = -1;
+    }
+
+    // Split r in halves down to the job's grain, pushing each right half for
+    // others to steal, then run the leftmost leaf here.
+    void execute(SM_WsContext &ctx, SM_WsRange r, bool root) {
+        SM_WsJob *job = r.job;
+        SM_Index b = r.begin;
+        SM_Index e = r.end;
+        if (r.limit > 1) {
+            while (e - b > job->grain) {
+                SM_Index m = b + (e - b) / 2;
+                SM_WsRange right = {job, m, e, r.limit, r.first, r.priority};
+                if (!ctx.deque->push(right)) break;
+                notify_work(root);
+                root = false;
+                e = m;
+            }
+        }
+        try {
+            job->run(job, b, e);
+        } catch (...) { /* bodies are wrapped in SM_GuardedBody; never reached */ }
+        SM_Index n = e - b;
+        // job may be gone once remaining hits zero: don't touch it after this
+        if (job->remaining.fetch_sub(n, std::memory_order_acq_rel) == n) notify_done();
+    }
+
+    // Steal from a random victim, preferring ranges of the highest priority
+    // in flight: while a higher-priority job runs, lower ones are only
+    // taken when a full sweep finds nothing better
+    bool steal_any(SM_WsContext &ctx, SM_WsRange &r) {
+        ctx.rng ^= ctx.rng << 13;
+        ctx.rng ^= ctx.rng >> 17;
+        ctx.rng ^= ctx.rng << 5;
+        int top = top_priority();
+        return steal_sweep(ctx, r, top) || (top > SM_PRIORITY_LOW && steal_sweep(ctx, r, SM_PRIORITY_LOW));
+    }
+
+    bool steal_sweep(SM_WsContext &ctx, SM_WsRange &r, int min_priority) {
+        int n = worker_count_.load(std::memory_order_acquire);
+        if (n > 0) {
+            int start = static_cast<int>(ctx.rng % static_cast<unsigned>(n));
+            for (int k = 0; k < n; ++k) {
+                int v = (start + k) % n;
+                if (v == ctx.index) continue;
+                Worker *w = workers_[v].load(std::memory_order_acquire);
+                if (w && w->deque.steal(r, ctx.index, min_priority)) return true;
+            }
+        }
+        unsigned used = external_used_.load(std::memory_order_acquire);
+        for (int i = 0; used; ++i, used >>= 1) {
+            if ((used & 1u) && &external_[i] != ctx.deque && external_[i].steal(r, ctx.index, min_priority))
+                return true;
+        }
+        return false;
+    }
+
+    void wait_job(SM_WsContext &ctx, SM_WsJob &job) {
+        Worker *self = ctx.index >= 0 ? workers_[ctx.index].load(std::memory_order_relaxed) : nullptr;
+        long long idle_since = -1;
+        while (job.remaining.load(std::memory_order_acquire) > 0) {
+            SM_WsRange r;
+            if (ctx.deque->pop(r) || (ctx.depth <= SM_MAX_STEAL_DEPTH && steal_any(ctx, r))) {
+                execute(ctx, r, false);
+                idle_since = -1;
+                continue;
+            }
+            if (SM_PoolTask *t = self ? take_mail(self) : nullptr) {
+                run(t);
+                idle_since = -1;
+                continue;
+            }
+            // keep polling for ranges to steal for the spin budget
+            long long now = sm_now_ns();
+            if (idle_since < 0) idle_since = now;
+            if (now - idle_since < sm_spin_ns()) {
+                sm_cpu_relax();
+                continue;
+            }
+            // Nothing to pop or steal: the rest of the job is running on
+            // other threads. Our own deque is empty, so sleeping here cannot
+            // hide work from anyone.
+            waiters_.fetch_add(1);
+            unsigned seq = done_seq_.load(std::memory_order_acquire);
+            if (job.remaining.load() > 0 && !(self && self->mail_count.load() > 0)) sm_futex_wait(done_seq_, seq);
+            waiters_.fetch_sub(1);
+            idle_since = -1;
+        }
+    }
+
+    static void *worker_main(void *start_void) {
+        WorkerStart *start = static_cast<WorkerStart *>(start_void);
+        SM_ThreadPool *self = start->pool;
+        Worker *me = start->worker;
+        SM_WsContext &ctx = sm_ws_context();
+        ctx.index = start->index;
+        ctx.deque = &me->deque;
+        ctx.rng = 0x9e3779b9u * static_cast<unsigned>(start->index + 1);
+        delete start;
+
+        long long idle_since = -1;
+        while (!self->stopping_.load(std::memory_order_relaxed)) {
+            SM_WsRange r;
+            if (SM_PoolTask *t = self->take_mail(me)) {
+                self->run(t);
+                idle_since = -1;
+                continue;
+            }
+            if (self->run_task()) {
+                idle_since = -1;
+                continue;
+            }
+            if (ctx.deque->pop(r) || self->steal_any(ctx, r)) {
+                self->execute(ctx, r, false);
+                idle_since = -1;
+                continue;
+            }
+            long long now = sm_now_ns();
+            if (idle_since < 0) idle_since = now;
+            if (now - idle_since < sm_spin_ns()) {
+                sm_cpu_relax();
+                continue;
+            }
+            // park: announce ourselves, then take one last look for work
+            unsigned e = self->epoch_.load();
+            self->sleepers_.fetch_add(1);
+            if (!self->tasks_.empty()) {
+                self->sleepers_.fetch_sub(1);
+                idle_since = -1;
+                continue;
+            }
+            if (self->steal_any(ctx, r)) {
+                self->sleepers_.fetch_sub(1);
+                self->execute(ctx, r, false);
+                idle_since = -1;
+                continue;
+            }
+            while (self->epoch_.load() == e && me->mail_count.load() == 0 && !self->stopping_.load())
+                sm_futex_wait(self->epoch_, e);
+            self->sleepers_.fetch_sub(1);
+            idle_since = -1;
+        }
+        return nullptr;
+    }
+
+    pthread_mutex_t mtx_; // ensure_workers and set_affinity
+    std::atomic<bool> stopping_;
+    std::atomic<int> waiters_;
+    std::atomic<int> worker_count_;
+    std::atomic<int> sleepers_;
+    std::atomic<unsigned> epoch_;    // bumped to wake idle workers
+    std::atomic<unsigned> done_seq_; // bumped to wake threads waiting for a call
+    std::atomic<Worker *> workers_[SM_MAX_WORKERS];
+    std::vector<int> cpu_order_;        // guarded by mtx_
+    std::atomic<int> active_[SM_PRIORITY_LEVELS];  // stealing jobs in flight per priority
+    std::atomic<unsigned> window_;      // rotates the first worker of concurrent jobs
+    std::atomic<int> core_workers_[SM_MAX_WORKERS];  // core_spread of cpu_order_
+    std::atomic<int> core_worker_count_;
+
+    std::atomic<unsigned> external_used_;
+    SM_WsDeque external_[SM_MAX_EXTERNAL];
+    SM_TaskQueue tasks_;
+};
+
+// Pin the pool's threads (and, by default, the calling thread) according to
+// the policy; SM_AFFINITY_NONE releases the pinning. Combine with
+// sm_schedule_static() so each index range is first touched and later
+// revisited by the same thread on the same CPU.
+inline void sm_set_affinity(const SM_Affinity &aff) {
+    SM_ThreadPool::instance().set_affinity(aff);
+}
+
+// ---------------------------------------------------------------------------
+// Instrumentation
+// ---------------------------------------------------------------------------
+
+// Hardware counters sampled per region when enabled: cycles, retired
+// instructions and last-level cache misses
+enum SM_PerfEvent { SM_PERF_CYCLES, SM_PERF_INSTRUCTIONS, SM_PERF_LLC_MISSES, SM_PERF_EVENTS };
+
+inline std::atomic<bool> &sm_perf_slot() {
+    static std::atomic<bool> on([] {
+        const char *env = getenv("SM_PERF_COUNTERS");
+        return env != nullptr && atoi(env) != 0;
+    }());
+    return on;
+}
+
+// Off by default (SM_PERF_COUNTERS=1 in the environment turns them on).
+// They are read only for calls seen by an installed observer, so with
+// either switch off a call does no extra work.
+inline void sm_set_perf_counters(bool on) { sm_perf_slot().store(on, std::memory_order_relaxed); }
+inline bool sm_perf_counters() { return sm_perf_slot().load(std::memory_order_relaxed); }
+
+// The calling thread's counter group, opened with perf_event_open on first
+// use and kept until the thread exits. It counts this thread in user mode
+// only (allowed at perf_event_paranoid 2) and is read with one read() per
+// sample. Events the kernel or CPU does not offer are left out.
+class SM_PerfGroup {
+public:
+    static SM_PerfGroup &local() {
+        static thread_local SM_PerfGroup group;
+        return group;
+    }
+
+    // Current counts into values, -1 for missing events; false when none
+    // could be opened
+    bool read(long long *values) const {
+        if (leader_ < 0) return false;
+        unsigned long long buf[1 + SM_PERF_EVENTS];
+        if (::read(leader_, buf, sizeof(buf)) < static_cast<ssize_t>(sizeof(unsigned long long) * (1 + members_)))
+            return false;
+        for (int k = 0; k < SM_PERF_EVENTS; ++k)
+            values[k] = pos_[k] < 0 ? -1 : static_cast<long long>(buf[1 + pos_[k]]);
+        return true;
+    }
+
+private:
+    SM_PerfGroup() : leader_(-1), members_(0) {
+        static const unsigned long long config[SM_PERF_EVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+        for (int k = 0; k < SM_PERF_EVENTS; ++k) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = config[k];
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd_[k] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0));
+            pos_[k] = fd_[k] >= 0 ? members_++ : -1;
+            if (fd_[k] >= 0 && leader_ < 0) leader_ = fd_[k];
+        }
+    }
+
+    ~SM_PerfGroup() {
+        for (int k = 0; k < SM_PERF_EVENTS; ++k)
+            if (fd_[k] >= 0) close(fd_[k]);
+    }
+
+    SM_PerfGroup(const SM_PerfGroup &) = delete;
+    SM_PerfGroup &operator=(const SM_PerfGroup &) = delete;
+
+    int fd_[SM_PERF_EVENTS];
+    int pos_[SM_PERF_EVENTS];  // index in the group read, -1 if not opened
+    int leader_;
+    int members_;
+};
+
+// What one parallel_for / parallel_reduce call did. Per-thread arrays use the
+// sm_thread_slot layout: [caller, worker 0, worker 1, ..., other threads].
+struct SM_CallStats {
+    const char *label;           // e.g. "parallel_for(1D)"
+    int num_threads;             // numThreads the call asked for
+    long long wall_ns;           // call duration on the issuing thread
+    long long chunks;            // body invocations (slices, leaves or tiles)
+    long long busy_ns;           // time spent inside the body, summed over threads
+    long long max_busy_ns;       // busiest thread
+    double imbalance;            // max_busy_ns / (busy_ns / num_threads); 1.0 is perfect
+    std::vector<long long> thread_busy_ns;
+    std::vector<long long> thread_chunks;
+    // Hardware counters inside the body, with sm_set_perf_counters(true):
+    // totals over threads indexed by SM_PerfEvent, -1 where the event is
+    // unavailable (all -1 when counters are off), and per-thread arrays
+    // (empty when off)
+    long long perf[SM_PERF_EVENTS];
+    std::vector<long long> thread_perf[SM_PERF_EVENTS];
+
+    // Instructions per cycle, LLC misses per thousand instructions, and the
+    // memory traffic those misses imply (one cache line each) over the
+    // call's wall time; 0 when the counters are missing
+    double ipc() const {
+        return perf[SM_PERF_CYCLES] > 0 && perf[SM_PERF_INSTRUCTIONS] >= 0
+                   ? static_cast<double>(perf[SM_PERF_INSTRUCTIONS]) / perf[SM_PERF_CYCLES] : 0.0;
+    }
+    double llc_mpki() const {
+        return perf[SM_PERF_INSTRUCTIONS] > 0 && perf[SM_PERF_LLC_MISSES] >= 0
+                   ? 1000.0 * perf[SM_PERF_LLC_MISSES] / perf[SM_PERF_INSTRUCTIONS] : 0.0;
+    }
+    double miss_gb_per_s() const {
+        return wall_ns > 0 && perf[SM_PERF_LLC_MISSES] >= 0
+                   ? static_cast<double>(perf[SM_PERF_LLC_MISSES]) * SM_CACHE_LINE / wall_ns : 0.0;
+    }
+};
+
+// Receives one SM_CallStats per call. Installed process-wide; called on the
+// issuing thread after the call's work has finished.
+class SM_Observer {
+public:
+    virtual ~SM_Observer() {}
+    virtual void on_call(const SM_CallStats &stats) = 0;
+};
+
+inline std::atomic<SM_Observer *> &sm_observer_slot() {
+    static std::atomic<SM_Observer *> obs(nullptr);
+    return obs;
+}
+
+// Install (or, with nullptr, remove) the process-wide observer. With none
+// installed a call costs one relaxed load; nothing is timed or counted.
+inline void sm_set_observer(SM_Observer *obs) { sm_observer_slot().store(obs, std::memory_order_release); }
+inline SM_Observer *sm_get_observer() { return sm_observer_slot().load(std::memory_order_acquire); }
+
+// Prints one line per call, like the old built-in timing output
+class SM_PrintObserver : public SM_Observer {
+public:
+    explicit SM_PrintObserver(std::ostream &os = std::cout) : os_(os) {}
+    void on_call(const SM_CallStats &st) override {
+        // calls under a millisecond are shown in microseconds
+        bool us = st.wall_ns < 1000000;
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "[SimpleMultithreader] %s time = %.3f %s (threads=%d chunks=%lld imbalance=%.2f)\n",
+                 st.label, st.wall_ns / (us ? 1e3 : 1e6), us ? "us" : "ms", st.num_threads, st.chunks,
+                 st.imbalance);
+        os_ << line;
+        if (st.perf[SM_PERF_CYCLES] >= 0 || st.perf[SM_PERF_LLC_MISSES] >= 0) {
+            snprintf(line, sizeof(line), "[SimpleMultithreader]   cycles=%lld instructions=%lld ipc=%.2f "
+                     "llc_misses=%lld mpki=%.2f (~%.2f GB/s)\n", st.perf[SM_PERF_CYCLES],
+                     st.perf[SM_PERF_INSTRUCTIONS], st.ipc(), st.perf[SM_PERF_LLC_MISSES], st.llc_mpki(),
+                     st.miss_gb_per_s());
+            os_ << line;
+        }
+    }
+private:
+    std::ostream &os_;
+};
+
+// Chunks a thread's trace ring holds; older events are overwritten
+#ifndef SM_TRACE_EVENTS
+#define SM_TRACE_EVENTS (1 << 16)
+#endif
+
+// One chunk (or, with begin = end = -1, a whole call on its issuing thread)
+struct SM_TraceEvent {
+    const char *label;
+    unsigned long long call;
+    long long t0_ns, t1_ns;
+    SM_Index begin, end;
+};
+
+// Single-producer ring of one thread's events. Each slot is a seqlock:
+// the owner marks it odd (2h + 1) while writing the event of position h and
+// even (2h + 2) once done, then publishes head. A dump copies the slots of
+// positions [head - capacity, head) and keeps a copy only if the slot's
+// sequence was 2k + 2 both before and after, so an event being overwritten
+// is dropped rather than torn.
+struct SM_TraceRing {
+    struct Slot {
+        std::atomic<unsigned long long> seq;
+        std::atomic<const char *> label;
+        std::atomic<unsigned long long> call;
+        std::atomic<long long> t0_ns, t1_ns;
+        std::atomic<SM_Index> begin, end;
+        Slot() : seq(0) {}
+    };
+
+    std::vector<Slot> slots;
+    std::atomic<unsigned long long> head;
+    int worker;  // pool worker index, or -1
+    int tid;     // order of registration, the trace's thread id
+
+    void push(const SM_TraceEvent &ev) {
+        unsigned long long h = head.load(std::memory_order_relaxed);
+        Slot &s = slots[h % slots.size()];
+        s.seq.store(2 * h + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s.label.store(ev.label, std::memory_order_relaxed);
+        s.call.store(ev.call, std::memory_order_relaxed);
+        s.t0_ns.store(ev.t0_ns, std::memory_order_relaxed);
+        s.t1_ns.store(ev.t1_ns, std::memory_order_relaxed);
+        s.begin.store(ev.begin, std::memory_order_relaxed);
+        s.end.store(ev.end, std::memory_order_relaxed);
+        s.seq.store(2 * h + 2, std::memory_order_release);
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    // Copy the event of position k; false if the slot no longer (or not
+    // yet) holds it in full
+    bool read(unsigned long long k, SM_TraceEvent &ev) const {
+        const Slot &s = slots[k % slots.size()];
+        if (s.seq.load(std::memory_order_acquire) != 2 * k + 2) return false;
+        ev.label = s.label.load(std::memory_order_relaxed);
+        ev.call = s.call.load(std::memory_order_relaxed);
+        ev.t0_ns = s.t0_ns.load(std::memory_order_relaxed);
+        ev.t1_ns = s.t1_ns.load(std::memory_order_relaxed);
+        ev.begin = s.begin.load(std::memory_order_relaxed);
+        ev.end = s.end.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return s.seq.load(std::memory_order_relaxed) == 2 * k + 2;
+    }
+};
+
+// Process-wide trace state. Rings are registered once per thread and never
+// freed, so threads that exit before the dump still appear in it.
+struct SM_TraceState {
+    std::atomic<bool> on;
+    std::atomic<long long> start_ns;
+    std::atomic<unsigned long long> next_call;
+    size_t capacity;
+    pthread_mutex_t mtx;  // rings
+    std::vector<SM_TraceRing *> rings;
+    std::string exit_path;
+};
+
+inline bool sm_trace_dump(const char *path);
+
+inline SM_TraceState &sm_trace_state() {
+    static SM_TraceState *st = [] {
+        SM_TraceState *t = new SM_TraceState();
+        t->on.store(false, std::memory_order_relaxed);
+        t->start_ns.store(0, std::memory_order_relaxed);
+        t->next_call.store(1, std::memory_order_relaxed);
+        t->capacity = SM_TRACE_EVENTS;
+        pthread_mutex_init(&t->mtx, nullptr);
+        // SM_TRACE=file.json traces from the start and dumps at exit
+        if (const char *env = getenv("SM_TRACE")) {
+            t->exit_path = env;
+            t->start_ns.store(sm_now_ns(), std::memory_order_relaxed);
+            t->on.store(true, std::memory_order_relaxed);
+            atexit([] { sm_trace_dump(sm_trace_state().exit_path.c_str()); });
+        }
+        return t;
+    }();
+    return *st;
+}
+
+// Whether chunks are being traced. One relaxed load, so callers can test it
+// on every call.
+inline bool sm_tracing() { return sm_trace_state().on.load(std::memory_order_relaxed); }
+
+// Start tracing: every chunk of every parallel call from now on is logged
+// with its thread, range and begin/end time. events_per_thread sizes the
+// rings of threads that have not traced yet. Earlier events are left out
+// of later dumps.
+inline void sm_trace_start(size_t events_per_thread = SM_TRACE_EVENTS) {
+    SM_TraceState &st = sm_trace_state();
+    pthread_mutex_lock(&st.mtx);
+    st.capacity = std::max<size_t>(1, events_per_thread);
+    pthread_mutex_unlock(&st.mtx);
+    st.start_ns.store(sm_now_ns(), std::memory_order_relaxed);
+    st.on.store(true, std::memory_order_release);
+}
+
+inline void sm_trace_stop() { sm_trace_state().on.store(false, std::memory_order_release); }
+
+// The calling thread's ring, registered on first use
+inline SM_TraceRing &sm_trace_ring() {
+    static thread_local SM_TraceRing *ring = nullptr;
+    if (!ring) {
+        SM_TraceState &st = sm_trace_state();
+        SM_TraceRing *r = new SM_TraceRing();
+        r->head.store(0, std::memory_order_relaxed);
+        r->worker = sm_ws_context().index;
+        pthread_mutex_lock(&st.mtx);
+        std::vector<SM_TraceRing::Slot>(st.capacity).swap(r->slots);
+        r->tid = static_cast<int>(st.rings.size());
+        st.rings.push_back(r);
+        pthread_mutex_unlock(&st.mtx);
+        ring = r;
+    }
+    return *ring;
+}
+
+// Write the events since sm_trace_start() (or since start-up with SM_TRACE)
+// as Chrome trace JSON, for chrome://tracing or ui.perfetto.dev: one track
+// per thread, a "chunk" slice per chunk with its [begin, end) range and
+// call id, and a "call" slice per call on its issuing thread. Safe to call
+// while tracing continues; events overwritten during the copy are dropped.
+// Returns false if the file cannot be written.
+inline bool sm_trace_dump(const char *path) {
+    SM_TraceState &st = sm_trace_state();
+    FILE *f = fopen(path, "w");
+    if (!f) return false;
+    long long start = st.start_ns.load(std::memory_order_relaxed);
+    pthread_mutex_lock(&st.mtx);
+    std::vector<SM_TraceRing *> rings = st.rings;
+    pthread_mutex_unlock(&st.mtx);
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    fprintf(f, "  {\"ph\": \"M\", \"name\": \"process_name\", \"pid\": 1, \"args\": {\"name\": \"SimpleMultithreader\"}}");
+    std::vector<std::pair<unsigned long long, SM_TraceEvent>> copy;  // (position, event)
+    for (SM_TraceRing *r : rings) {
+        char name[32];
+        if (r->worker >= 0) snprintf(name, sizeof(name), "worker %d", r->worker);
+        else snprintf(name, sizeof(name), "thread %d", r->tid);
+        fprintf(f, ",\n  {\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                r->tid, name);
+        unsigned long long cap = r->slots.size();
+        unsigned long long h1 = r->head.load(std::memory_order_acquire);
+        unsigned long long first = h1 > cap ? h1 - cap : 0;
+        copy.clear();
+        for (unsigned long long k = first; k < h1; ++k) {
+            SM_TraceEvent ev;
+            if (r->read(k, ev)) copy.push_back(std::make_pair(k, ev));
+        }
+        // the owner may be writing position h2 (the slot of h2 - cap) already
+        unsigned long long h2 = r->head.load(std::memory_order_acquire);
+        unsigned long long valid = h2 + 1 > cap ? h2 + 1 - cap : 0;
+        for (const std::pair<unsigned long long, SM_TraceEvent> &c : copy) {
+            const SM_TraceEvent &ev = c.second;
+            if (c.first < valid || ev.t0_ns < start) continue;
+            bool call = ev.begin < 0;
+            fprintf(f, ",\n  {\"ph\": \"X\", \"cat\": \"%s\", \"name\": \"%s\", \"pid\": 1, \"tid\": %d, "
+                       "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"call\": %llu",
+                    call ? "call" : "chunk", ev.label, r->tid, (ev.t0_ns - start) / 1e3, (ev.t1_ns - ev.t0_ns) / 1e3,
+                    ev.call);
+            if (!call) fprintf(f, ", \"begin\": %lld, \"end\": %lld", ev.begin, ev.end);
+            fprintf(f, "}}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0;
+}
+
+// Per-thread busy time and chunk count for one observed call
+struct alignas(SM_CACHE_LINE) SM_ThreadCounters {
+    std::atomic<long long> busy_ns;
+    std::atomic<long long> chunks;
+    std::atomic<long long> perf[SM_PERF_EVENTS];
+    std::atomic<int> perf_seen;  // bit k: event k was counted at least once
+};
+
+class SM_CallRecorder {
+public:
+    SM_CallRecorder(const char *label, int numThreads)
+        : label_(label), num_threads_(numThreads), issuer_(&sm_ws_context()), perf_(sm_perf_counters()),
+          call_(sm_tracing() ? sm_trace_state().next_call.fetch_add(1, std::memory_order_relaxed) : 0) {
+        SM_ThreadPool &pool = SM_ThreadPool::instance();
+        pool.ensure_workers(numThreads - 1);
+        count_ = pool.size() + 1;
+        void *mem = nullptr;
+        if (posix_memalign(&mem, SM_CACHE_LINE, sizeof(SM_ThreadCounters) * (count_ + 1)) != 0)
+            throw std::bad_alloc();
+        slots_ = static_cast<SM_ThreadCounters *>(mem);
+        for (int k = 0; k <= count_; ++k) {
+            new (&slots_[k]) SM_ThreadCounters();
+            slots_[k].busy_ns.store(0, std::memory_order_relaxed);
+            slots_[k].chunks.store(0, std::memory_order_relaxed);
+            for (int p = 0; p < SM_PERF_EVENTS; ++p) slots_[k].perf[p].store(0, std::memory_order_relaxed);
+            slots_[k].perf_seen.store(0, std::memory_order_relaxed);
+        }
+        t0_ = sm_now_ns();
+    }
+
+    ~SM_CallRecorder() { free(slots_); }
+
+    // Run chunk [b, e) as f() and add its time (with counters on, also the
+    // running thread's counter deltas around it; when traced, a chunk event).
+    // f must not throw.
+    template<typename F>
+    void measure(SM_Index b, SM_Index e, F &&f) {
+        if (!perf_) {
+            long long t0 = sm_now_ns();
+            f();
+            long long t1 = sm_now_ns();
+            add(t1 - t0);
+            trace(b, e, t0, t1);
+            return;
+        }
+        const SM_PerfGroup &group = SM_PerfGroup::local();
+        long long before[SM_PERF_EVENTS] = {}, after[SM_PERF_EVENTS] = {};
+        bool ok = group.read(before);
+        long long t0 = sm_now_ns();
+        f();
+        long long t1 = sm_now_ns();
+        trace(b, e, t0, t1);
+        if (!ok || !group.read(after)) {
+            add(t1 - t0);
+            return;
+        }
+        for (int p = 0; p < SM_PERF_EVENTS; ++p) after[p] = before[p] < 0 ? -1 : after[p] - before[p];
+        add(t1 - t0, after);
+    }
+
+    // perf: counter deltas of the chunk (-1 for missing events), or nullptr
+    void add(long long ns, const long long *perf = nullptr) {
+        // the overflow slot (index count_) may be shared, hence atomics
+        SM_ThreadCounters &c = slots_[sm_thread_slot(issuer_, count_)];
+        c.busy_ns.fetch_add(ns, std::memory_order_relaxed);
+        c.chunks.fetch_add(1, std::memory_order_relaxed);
+        if (!perf) return;
+        int seen = 0;
+        for (int p = 0; p < SM_PERF_EVENTS; ++p) {
+            if (perf[p] < 0) continue;
+            c.perf[p].fetch_add(perf[p], std::memory_order_relaxed);
+            seen |= 1 << p;
+        }
+        c.perf_seen.fetch_or(seen, std::memory_order_relaxed);
+    }
+
+    // Report to obs (if any) and close the call's trace slice
+    void finish(SM_Observer *obs) {
+        if (call_) {
+            SM_TraceEvent ev = {label_, call_, t0_, sm_now_ns(), -1, -1};
+            sm_trace_ring().push(ev);
+        }
+        if (!obs) return;
+        SM_CallStats st;
+        st.label = label_;
+        st.num_threads = num_threads_;
+        st.wall_ns = sm_now_ns() - t0_;
+        st.chunks = 0;
+        st.busy_ns = 0;
+        st.max_busy_ns = 0;
+        int seen = 0;
+        for (int p = 0; p < SM_PERF_EVENTS; ++p) st.perf[p] = 0;
+        for (int k = 0; k <= count_; ++k) {
+            long long b = slots_[k].busy_ns.load(std::memory_order_relaxed);
+            long long c = slots_[k].chunks.load(std::memory_order_relaxed);
+            st.thread_busy_ns.push_back(b);
+            st.thread_chunks.push_back(c);
+            st.busy_ns += b;
+            st.chunks += c;
+            st.max_busy_ns = std::max(st.max_busy_ns, b);
+            if (!perf_) continue;
+            seen |= slots_[k].perf_seen.load(std::memory_order_relaxed);
+            for (int p = 0; p < SM_PERF_EVENTS; ++p) {
+                long long v = slots_[k].perf[p].load(std::memory_order_relaxed);
+                st.thread_perf[p].push_back(v);
+                st.perf[p] += v;
+            }
+        }
+        for (int p = 0; p < SM_PERF_EVENTS; ++p)
+            if (!(seen & (1 << p))) st.perf[p] = -1;
+        st.imbalance = st.busy_ns > 0 ? st.max_busy_ns * static_cast<double>(num_threads_) / st.busy_ns : 1.0;
+        obs->on_call(st);
+    }
+
+private:
+    SM_CallRecorder(const SM_CallRecorder &) = delete;
+    SM_CallRecorder &operator=(const SM_CallRecorder &) = delete;
+
+    const char *label_;
+    int num_threads_;
+    const SM_WsContext *issuer_;
+    void trace(SM_Index b, SM_Index e, long long t0, long long t1) {
+        if (!call_) return;
+        SM_TraceEvent ev = {label_, call_, t0, t1, b, e};
+        sm_trace_ring().push(ev);
+    }
+
+    bool perf_;
+    unsigned long long call_;  // trace call id, 0 when not traced
+    int count_;
+    SM_ThreadCounters *slots_;
+    long long t0_;
+};
+
+// Times each chunk of the wrapped body into the recorder
+template<typename BodyType>
+struct SM_TimedBody {
+    BodyType &inner;
+    SM_CallRecorder &rec;
+    SM_TimedBody(BodyType &b, SM_CallRecorder &r) : inner(b), rec(r) {}
+    void operator()(SM_Index s, SM_Index e) {
+        rec.measure(s, e, [&] { inner(s, e); });
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Errors and cancellation
+// ---------------------------------------------------------------------------
+
+// Shared by all chunks of one call: the first exception thrown by any chunk
+// and a cancellation flag checked before each chunk starts. A call issued
+// from inside a chunk links to the enclosing call, so cancelling the outer
+// call also stops the chunks of nested ones.
+struct SM_CallControl {
+    std::atomic<bool> cancelled;
+    std::atomic<bool> failed;
+    std::exception_ptr error;     // written once, by the thread that set failed
+    SM_CallControl *parent;
+    SM_JobOptions options;        // the thread's SM_JobScope, else inherited from parent
+
+    explicit SM_CallControl(SM_CallControl *p)
+        : cancelled(false), failed(false), parent(p), options(p ? p->options : SM_JobOptions()) {
+        if (const SM_JobOptions *scope = sm_job_scope()) options = *scope;
+    }
+
+    bool is_cancelled() const {
+        for (const SM_CallControl *c = this; c; c = c->parent)
+            if (c->cancelled.load(std::memory_order_relaxed)) return true;
+        return false;
+    }
+
+    void fail(std::exception_ptr e) {
+        if (!failed.exchange(true, std::memory_order_acq_rel)) error = e;
+        cancelled.store(true, std::memory_order_relaxed);
+    }
+};
+
+// the call whose chunk this thread is running, if any
+inline SM_CallControl *&sm_current_call() {
+    static thread_local SM_CallControl *current = nullptr;
+    return current;
+}
+
+// Options a call issued here now would run with
+inline SM_JobOptions sm_job_options() {
+    if (const SM_JobOptions *scope = sm_job_scope()) return *scope;
+    if (const SM_CallControl *c = sm_current_call()) return c->options;
+    return SM_JobOptions();
+}
+
+template<typename BodyType>
+struct SM_GuardedBody {
+    BodyType &inner;
+    SM_CallControl &ctl;
+    SM_GuardedBody(BodyType &b, SM_CallControl &c) : inner(b), ctl(c) {}
+    void operator()(SM_Index s, SM_Index e) {
+        if (ctl.is_cancelled()) return;
+        SM_CallControl *&current = sm_current_call();
+        SM_CallControl *outer = current;
+        current = &ctl;
+        try {
+            inner(s, e);
+        } catch (...) {
+            ctl.fail(std::current_exception());
+        }
+        current = outer;
+    }
+};
+
+// Called from inside a parallel lambda: stop the innermost enclosing call.
+// Chunks that have not started are skipped and the call returns normally.
+inline void sm_cancel() {
+    if (SM_CallControl *c = sm_current_call()) c->cancelled.store(true, std::memory_order_relaxed);
+}
+
+// True once the enclosing call was cancelled or one of its chunks threw;
+// long chunks can poll it to stop early.
+inline bool sm_cancelled() {
+    SM_CallControl *c = sm_current_call();
+    return c && c->is_cancelled();
+}
+
+// ---------------------------------------------------------------------------
+// Auto mode (numThreads == 0)
+// ---------------------------------------------------------------------------
+
+// With no history, ranges shorter than this run inline on the caller and
+// longer ones get one thread per this many indices (up to the CPU count)
+#ifndef SM_AUTO_INLINE_INDICES
+#define SM_AUTO_INLINE_INDICES 4096
+#endif
+// Calls whose measured serial cost is below this (ns) run inline
+#ifndef SM_AUTO_INLINE_NS
+#define SM_AUTO_INLINE_NS 20000
+#endif
+// Each extra thread must get at least this much work (ns)
+#ifndef SM_AUTO_THREAD_NS
+#define SM_AUTO_THREAD_NS 20000
+#endif
+// Smallest stolen or claimed chunk (ns of work)
+#ifndef SM_AUTO_LEAF_NS
+#define SM_AUTO_LEAF_NS 2000
+#endif
+
+// Cost history of one call site. The site is keyed on the chunk body type,
+// which embeds the lambda's type, so every lambda expression gets its own.
+struct SM_AutoSite {
+    std::atomic<long long> ps_per_index;   // serial cost estimate, picoseconds; 0 = unknown
+    std::atomic<unsigned> calls;
+    SM_AutoSite() : ps_per_index(0), calls(0) {}
+};
+
+template<typename Key>
+SM_AutoSite &sm_auto_site() {
+    static SM_AutoSite site;
+    return site;
+}
+
+// Picks numThreads and the grain of an auto-mode call on construction and
+// feeds the call's wall time back into the site's estimate on destruction.
+// Calls with an explicit numThreads pass through untouched.
+class SM_AutoCall {
+public:
+    SM_AutoCall(SM_AutoSite &site, SM_Index n, int &numThreads, SM_Schedule &sched)
+        : site_(numThreads == 0 ? &site : nullptr), n_(n), threads_(1), t0_(0) {
+        if (!site_) return;
+        long long ps = site.ps_per_index.load(std::memory_order_relaxed);
+        unsigned call = site.calls.fetch_add(1, std::memory_order_relaxed);
+        int cpus = sm_cpu_count();
+        if (ps == 0) {
+            threads_ = n < SM_AUTO_INLINE_INDICES ? 1
+                     : static_cast<int>(std::min<SM_Index>(cpus, n / SM_AUTO_INLINE_INDICES));
+        } else {
+            double est_ns = static_cast<double>(ps) * n / 1000.0;
+            threads_ = static_cast<int>(std::min<double>(cpus, est_ns / SM_AUTO_THREAD_NS));
+            // now and then re-measure a cheap parallel call serially, so an
+            // estimate inflated by fork/join overhead can come back down
+            if (est_ns < 8.0 * SM_AUTO_INLINE_NS && call % 32 == 31) threads_ = 1;
+            if (est_ns < SM_AUTO_INLINE_NS) threads_ = 1;
+            if (sched.chunk <= 0 && threads_ > 1) {
+                SM_Index leaf = std::max<SM_Index>(1, SM_AUTO_LEAF_NS * 1000LL / ps);
+                if (sched.kind == SM_SCHEDULE_STEAL || sched.kind == SM_SCHEDULE_DYNAMIC)
+                    sched.chunk = static_cast<int>(std::min<SM_Index>(INT_MAX, std::max(leaf, n / (8LL * threads_))));
+                else if (sched.kind == SM_SCHEDULE_GUIDED)
+                    sched.chunk = static_cast<int>(std::min<SM_Index>(INT_MAX, leaf));
+            }
+        }
+        threads_ = std::max(1, threads_);
+        numThreads = threads_;
+        t0_ = sm_now_ns();
+    }
+
+    ~SM_AutoCall() {
+        if (!site_ || n_ <= 0) return;
+        // wall time x threads over-counts the serial cost by the parallel
+        // overhead; inline runs give the exact figure
+        double sample = (sm_now_ns() - t0_) * 1000.0 * threads_ / n_;
+        long long s = std::max(1LL, static_cast<long long>(sample));
+        long long old = site_->ps_per_index.load(std::memory_order_relaxed);
+        site_->ps_per_index.store(old == 0 ? s : (3 * old + s) / 4, std::memory_order_relaxed);
+    }
+
+private:
+    SM_AutoCall(const SM_AutoCall &) = delete;
+    SM_AutoCall &operator=(const SM_AutoCall &) = delete;
+
+    SM_AutoSite *site_;
+    SM_Index n_;
+    int threads_;
+    long long t0_;
+};
+
+// Split [low, high) into numThreads contiguous pieces, run all but the last
+// on the pool and the last on the calling thread. The piece records come
+// from the calling thread's arena and the body stays on the caller's stack.
+// `spread` sends piece t to pool.core_worker(t) rather than worker t.
+template<typename BodyType>
+void sm_run_pieces(SM_Index low, SM_Index high, BodyType &body, int numThreads,
+                   SM_Priority prio = SM_PRIORITY_NORMAL, bool spread = false) {
+    int to_create = numThreads - 1;
+    SM_ThreadPool &pool = SM_ThreadPool::instance();
+    pool.ensure_workers(spread && to_create > 0 ? pool.core_worker(to_create - 1) + 1 : to_create);
+    SM_TaskGroup group;
+    SM_ArenaScope scope;
+    SM_ThreadArg<BodyType> *args =
+        static_cast<SM_ThreadArg<BodyType> *>(scope.arena.alloc(sizeof(SM_ThreadArg<BodyType>) * to_create));
+
+    // piece t always goes to worker t, so repeated calls over the same range
+    // touch the same data from the same (possibly pinned) thread
+    for (int t = 0; t < to_create; ++t) {
+        SM_ThreadArg<BodyType> *arg = new (&args[t]) SM_ThreadArg<BodyType>();
+        arg->run = sm_thread_entry<BodyType>;
+        arg->body = &body;
+        sm_piece(low, high, numThreads, t, arg->start_idx, arg->end_idx);
+        pool.submit(spread ? pool.core_worker(t) : t, arg, group, prio);
+    }
+    pool.flush();
+
+    // main thread does last piece
+    // (the group lives on this stack, so wait for the workers even if it throws)
+    SM_Index b, e;
+    sm_piece(low, high, numThreads, to_create, b, e);
+    try {
+        body(b, e);
+    } catch (...) {
+        pool.wait(group);
+        throw;
+    }
+
+    pool.wait(group);
+}
+
+// ---------------------------------------------------------------------------
+// Streaming loops: bandwidth-knee calibration
+// ---------------------------------------------------------------------------
+
+// The knee is the fewest threads reaching this fraction of the best copy
+// bandwidth measured on 1 .. sm_physical_cores() threads
+#ifndef SM_STREAM_KNEE
+#define SM_STREAM_KNEE 0.9
+#endif
+
+// Bytes of each of the calibration's two arrays: twice the L3 size, kept
+// within these bounds (virtual machines often report the host's whole L3)
+#ifndef SM_STREAM_CALIBRATION_MIN_BYTES
+#define SM_STREAM_CALIBRATION_MIN_BYTES (32L << 20)
+#endif
+#ifndef SM_STREAM_CALIBRATION_MAX_BYTES
+#define SM_STREAM_CALIBRATION_MAX_BYTES (128L << 20)
+#endif
+
+// Copy bandwidth (bytes read and written per ns) of b = a on `threads`
+// static pieces placed like a streaming call's; best of three runs
+inline double sm_stream_bandwidth(const double *a, double *b, SM_Index n, int threads) {
+    double best = 0;
+    for (int rep = 0; rep < 3; ++rep) {
+        long long t0 = sm_now_ns();
+        auto copy = [&](SM_Index s, SM_Index e) {
+            for (SM_Index i = s; i < e; ++i) b[i] = a[i];
+        };
+        if (threads == 1) copy(0, n);
+        else sm_run_pieces(0, n, copy, threads, SM_PRIORITY_NORMAL, true);
+        best = std::max(best, 2.0 * sizeof(double) * n / std::max(1LL, sm_now_ns() - t0));
+    }
+    return best;
+}
+
+// One-time microbenchmark: copy bandwidth at 1, 2, 3, 4, 6, 8, ... threads
+// up to the physical core count, and the fewest threads within SM_STREAM_KNEE
+// of the best. Costs up to about a second, once per process (or once per
+// SM_STREAM_CACHE file).
+inline int sm_calibrate_stream_threads() {
+    int cores = sm_physical_cores();
+    if (cores <= 1) return 1;
+    long bytes = std::min<long>(SM_STREAM_CALIBRATION_MAX_BYTES,
+                                std::max<long>(SM_STREAM_CALIBRATION_MIN_BYTES,
+                                               2 * sm_cache_bytes(_SC_LEVEL3_CACHE_SIZE, 8L << 20)));
+    SM_Index n = bytes / static_cast<long>(sizeof(double));
+    std::unique_ptr<double[]> a(new double[n]), b(new double[n]);
+    // first touch on the same pieces the widest run uses
+    auto init = [&](SM_Index s, SM_Index e) {
+        for (SM_Index i = s; i < e; ++i) a[i] = b[i] = 1.0;
+    };
+    sm_run_pieces(0, n, init, cores, SM_PRIORITY_NORMAL, true);
+    std::vector<std::pair<int, double>> runs;
+    for (int t = 1; t <= cores; t = std::max(t + 1, t * 3 / 2)) runs.push_back(std::make_pair(t, 0.0));
+    if (runs.back().first != cores) runs.push_back(std::make_pair(cores, 0.0));
+    double best = 0;
+    for (std::pair<int, double> &r : runs) {
+        r.second = sm_stream_bandwidth(a.get(), b.get(), n, r.first);
+        best = std::max(best, r.second);
+    }
+    for (const std::pair<int, double> &r : runs)
+        if (r.second >= SM_STREAM_KNEE * best) return r.first;
+    return cores;
+}
+
+inline std::atomic<int> &sm_stream_slot() {
+    static std::atomic<int> threads(0);
+    return threads;
+}
+
+// Fix the streaming thread cap (0: calibrate again on next use)
+inline void sm_set_stream_threads(int n) {
+    sm_stream_slot().store(std::max(0, n), std::memory_order_relaxed);
+}
+
+// Streaming calls shorter than this never trigger the calibration (they
+// run on the provisional cap until a longer call has measured the knee)
+#ifndef SM_STREAM_CALIBRATE_INDICES
+#define SM_STREAM_CALIBRATE_INDICES (1 << 20)
+#endif
+
+// Thread cap of streaming calls: SM_STREAM_THREADS from the environment,
+// else a value cached in the file SM_STREAM_CACHE names, else calibrated
+// (then written to that file, when set), capped at the physical cores; a
+// value given to sm_set_stream_threads() is used as is. Only a thread
+// outside the pool and outside any parallel call calibrates, when
+// `calibrate` allows it: pool workers must keep serving their mailboxes,
+// so no thread ever waits for the calibration. Until it has run, callers
+// get a provisional cap of one thread per physical core.
+inline int sm_stream_threads(bool calibrate = true) {
+    int v = sm_stream_slot().load(std::memory_order_relaxed);
+    if (v > 0) return v;
+    static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+    if (pthread_mutex_trylock(&mtx) != 0) return sm_physical_cores();
+    v = sm_stream_slot().load(std::memory_order_relaxed);
+    if (v == 0) {
+        const char *env = getenv("SM_STREAM_THREADS");
+        const char *cache = getenv("SM_STREAM_CACHE");
+        if (env) v = atoi(env);
+        if (v <= 0 && cache) {
+            if (FILE *f = fopen(cache, "r")) {
+                if (fscanf(f, "%d", &v) != 1) v = 0;
+                fclose(f);
+            }
+        }
+        if (v <= 0 && calibrate && sm_ws_context().index < 0 && !sm_current_call()) {
+            v = sm_calibrate_stream_threads();
+            if (cache) {
+                if (FILE *f = fopen(cache, "w")) {
+                    fprintf(f, "%d\n", v);
+                    fclose(f);
+                }
+            }
+        }
+        if (v > 0) {
+            v = std::max(1, std::min(v, sm_physical_cores()));
+            sm_stream_slot().store(v, std::memory_order_relaxed);
+        } else {
+            v = sm_physical_cores();
+        }
+    }
+    pthread_mutex_unlock(&mtx);
+    return v;
+}
+
+// Internal driver: run body over [low, high) on numThreads threads under the
+// given schedule
+template<typename BodyType>
+void sm_run_schedule(SM_Index low, SM_Index high, BodyType &body, int numThreads,
+                     const SM_Schedule &sched, SM_Priority prio = SM_PRIORITY_NORMAL) {
+    if (sched.kind == SM_SCHEDULE_DETERMINISTIC) {
+        // the same blocks at any thread count; thread t runs the t-th run of them
+        int blocks = sm_deterministic_blocks(high - low, sched.chunk);
+        SM_BlockBody<BodyType> blocked(body, low, high, blocks);
+        if (numThreads == 1) blocked(0, blocks);
+        else sm_run_pieces(0, blocks, blocked, std::min(numThreads, blocks), prio);
+    } else if (numThreads == 1) {
+        body(low, high);
+    } else if (sched.kind == SM_SCHEDULE_STEAL || sched.kind == SM_SCHEDULE_TILED) {
+        SM_Index n = high - low;
+        SM_Index grain = sched.chunk > 0 ? sched.chunk : std::max<SM_Index>(1, n / (8LL * numThreads));
+        SM_WsJobFor<BodyType> job(&body, n, grain);
+        SM_ThreadPool::instance().run_stealing(job, low, high, numThreads, prio);
+    } else if (sched.kind == SM_SCHEDULE_STATIC || sched.kind == SM_SCHEDULE_STREAMING) {
+        sm_run_pieces(low, high, body, numThreads, prio, sched.kind == SM_SCHEDULE_STREAMING);
+    } else {
+        // one piece per thread, each running the claim loop
+        SM_ClaimBody<BodyType> claim(body, low, high, numThreads, sched);
+        sm_run_pieces(0, numThreads, claim, numThreads, prio);
+    }
+}
+
+// Internal driver: run body over [low, high) on numThreads threads under the
+// given schedule, reporting to the installed observer (if any). Everything
+// per call lives on this stack or in the thread's arena; with no observer a
+// call on a warm pool does not touch the heap.
+template<typename BodyType>
+void sm_parallel_chunks(SM_Index low, SM_Index high, BodyType &body, int numThreads,
+                        const SM_Schedule &sched_in, const char *label) {
+    SM_Schedule sched = sched_in;
+    // (a first streaming call calibrates here, outside the auto-mode timing)
+    int stream_cap =
+        sched.kind == SM_SCHEDULE_STREAMING ? sm_stream_threads(high - low >= SM_STREAM_CALIBRATE_INDICES) : 0;
+    SM_AutoCall auto_call(sm_auto_site<BodyType>(), high - low, numThreads, sched);
+    // the first exception of any chunk cancels the rest and is rethrown here
+    SM_CallControl ctl(sm_current_call());
+    if (ctl.options.max_workers >= 0) numThreads = std::min(numThreads, ctl.options.max_workers + 1);
+    if (stream_cap > 0) numThreads = std::min(numThreads, stream_cap);
+    SM_Priority prio = ctl.options.priority;
+    SM_GuardedBody<BodyType> guarded(body, ctl);
+#if SM_INSTRUMENTATION
+    SM_Observer *obs = sm_get_observer();
+    if (obs || sm_tracing()) {
+        SM_CallRecorder rec(label, numThreads);
+        SM_TimedBody<SM_GuardedBody<BodyType>> timed(guarded, rec);
+        sm_run_schedule(low, high, timed, numThreads, sched, prio);
+        rec.finish(obs);
+    } else {
+        sm_run_schedule(low, high, guarded, numThreads, sched, prio);
+    }
+#else
+    (void)label;
+    sm_run_schedule(low, high, guarded, numThreads, sched, prio);
+#endif
+    if (ctl.error) std::rethrow_exception(ctl.error);
+}
+
+// Number of elements in a rows x cols space, or an error if it does not fit
+// in the 64-bit index space
+inline SM_Index sm_area_2d(SM_Index rows, SM_Index cols) {
+    if (rows > LLONG_MAX / cols) throw std::runtime_error("2D range too large");
+    return rows * cols;
+}
+
+// Internal driver - 2D (flattened)
+template<typename I, typename F>
+void sm_parallel_for_2d(I low1, I high1, I low2, I high2, F &&lambda, int numThreads,
+                        const SM_Schedule &sched) {
+    typedef typename std::decay<F>::type LambdaType;
+    SM_Index rows = static_cast<SM_Index>(high1) - static_cast<SM_Index>(low1);
+    SM_Index cols = static_cast<SM_Index>(high2) - static_cast<SM_Index>(low2);
+    SM_Index total = sm_area_2d(rows, cols);
+
+    if (sched.kind == SM_SCHEDULE_TILED) {
+        int ti = sched.tile_i;
+        int tj = sched.tile_j;
+        sm_auto_tile(ti, tj);
+        SM_TileGrid<I> grid(low1, high1, low2, high2, ti, tj);
+        SM_TiledBody2D<LambdaType, I> body(std::forward<F>(lambda), grid);
+        sm_parallel_chunks(0, grid.count(), body, numThreads, sm_schedule_steal(1), "parallel_for(2D tiled)");
+        return;
+    }
+
+    SM_FlatBody2D<LambdaType, I> body(std::forward<F>(lambda), low1, low2, cols);
+    sm_parallel_chunks(0, total, body, numThreads, sched, "parallel_for(2D)");
+}
+
+// Public API - 1D (std::function, kept for ABI-stable callers)
+inline void parallel_for(int low, int high, std::function<void(int)> &&lambda, int numThreads,
+                         SM_Schedule sched = SM_Schedule()) {
+    if (numThreads < 0) numThreads = 1;
+    if (low >= high) return;
+    SM_IndexBody<std::function<void(int)>> body(std::move(lambda));
+    sm_parallel_chunks(low, high, body, numThreads, sched, "parallel_for(1D)");
+}
+
+// Public API - 1D (any callable; the body is called by its own type and can be
+// inlined). The lambda receives indices of the bounds' common type.
+template<typename L, typename H, typename F>
+inline void parallel_for(L low_, H high_, F &&lambda, int numThreads,
+                         SM_Schedule sched = SM_Schedule()) {
+    typedef typename SM_IndexOf<L, H>::type I;
+    I low = static_cast<I>(low_), high = static_cast<I>(high_);
+    if (numThreads < 0) numThreads = 1;
+    if (low >= high) return;
+    SM_IndexBody<typename std::decay<F>::type, I> body(std::forward<F>(lambda));
+    sm_parallel_chunks(low, high, body, numThreads, sched, "parallel_for(1D)");
+}
+
+// Public API - 2D (low1..high1, low2..high2), std::function form.
+// Dynamic/guided chunk sizes count flattened (i, j) indices.
+inline void parallel_for(int low1, int high1, int low2, int high2,
+                         std::function<void(int,int)> &&lambda, int numThreads,
+                         SM_Schedule sched = SM_Schedule()) {
+    if (numThreads < 0) numThreads = 1;
+    if (low1 >= high1 || low2 >= high2) return;
+    sm_parallel_for_2d(low1, high1, low2, high2, std::move(lambda), numThreads, sched);
+}
+
+// Public API - 2D, any callable
+template<typename L1, typename H1, typename L2, typename H2, typename F>
+inline void parallel_for(L1 low1_, H1 high1_, L2 low2_, H2 high2_, F &&lambda, int numThreads,
+                         SM_Schedule sched = SM_Schedule()) {
+    typedef typename SM_IndexOf<L1, H1, L2, H2>::type I;
+    I low1 = static_cast<I>(low1_), high1 = static_cast<I>(high1_);
+    I low2 = static_cast<I>(low2_), high2 = static_cast<I>(high2_);
+    if (numThreads < 0) numThreads = 1;
+    if (low1 >= high1 || low2 >= high2) return;
+    sm_parallel_for_2d(low1, high1, low2, high2, std::forward<F>(lambda), numThreads, sched);
+}
+
+// ---------------------------------------------------------------------------
+// Fixed trip counts: parallel_for<N> and parallel_for<M, N>
+// ---------------------------------------------------------------------------
+
+// A fixed space is cut into about SM_FIXED_BLOCKS blocks whose bounds and
+// trip counts are compile-time constants, and the schedulers split the
+// block numbers. 1D blocks run as groups of SM_FIXED_UNROLL calls expanded
+// by templates; 2D blocks are whole rows, or equal segments of one row when
+// rows are long, walked with constant-trip column loops.
+#ifndef SM_FIXED_BLOCKS
+#define SM_FIXED_BLOCKS 64
+#endif
+#ifndef SM_FIXED_UNROLL
+#define SM_FIXED_UNROLL 8
+#endif
+
+constexpr SM_Index sm_round_up(SM_Index n, SM_Index m) { return (n + m - 1) / m * m; }
+
+// Indices per block of an n-index space: a multiple of SM_FIXED_UNROLL
+constexpr SM_Index sm_fixed_block(SM_Index n) {
+    return n <= SM_FIXED_UNROLL ? (n < 1 ? 1 : n)
+                                : sm_round_up((n + SM_FIXED_BLOCKS - 1) / SM_FIXED_BLOCKS, SM_FIXED_UNROLL);
+}
+
+constexpr int sm_log2(SM_Index n) { return n <= 1 ? 0 : 1 + sm_log2(n / 2); }
+
+// f(base), f(base + 1), ..., f(base + K - 1), expanded at compile time
+template<int K>
+struct SM_Unroll {
+    template<typename F, typename I>
+    static inline void run(F &f, I base) {
+        SM_Unroll<K - 1>::run(f, base);
+        f(static_cast<I>(base + (K - 1)));
+    }
+};
+
+template<>
+struct SM_Unroll<0> {
+    template<typename F, typename I>
+    static inline void run(F &, I) {}
+};
+
+// K calls from base: whole unrolled groups, then the unrolled remainder
+template<SM_Index K, typename F, typename I>
+inline void sm_fixed_run(F &f, I base) {
+    for (I g = 0; g < static_cast<I>(K / SM_FIXED_UNROLL); ++g)
+        SM_Unroll<SM_FIXED_UNROLL>::run(f, static_cast<I>(base + g * SM_FIXED_UNROLL));
+    SM_Unroll<static_cast<int>(K % SM_FIXED_UNROLL)>::run(f, static_cast<I>(base + K / SM_FIXED_UNROLL * SM_FIXED_UNROLL));
+}
+
+// Quotient and remainder by a compile-time W: shift and mask when W is a
+// power of two, otherwise division by the constant (which the compiler
+// turns into a multiply)
+template<SM_Index W, bool = (W & (W - 1)) == 0>
+struct SM_FixedWidth {
+    template<typename I> static I div(I f) { return f / static_cast<I>(W); }
+    template<typename I> static I mod(I f) { return f % static_cast<I>(W); }
+};
+
+template<SM_Index W>
+struct SM_FixedWidth<W, true> {
+    template<typename I> static I div(I f) { return f >> sm_log2(W); }
+    template<typename I> static I mod(I f) { return f & static_cast<I>(W - 1); }
+};
+
+// Index type of a fixed space: int when it fits
+template<SM_Index N>
+struct SM_FixedIndex {
+    typedef typename std::conditional<(N <= INT_MAX), int, SM_Index>::type type;
+};
+
+// 1D: every block but the last holds B indices, the last one R
+template<SM_Index N, typename F>
+struct SM_FixedBody {
+    static const SM_Index B = sm_fixed_block(N);
+    static const SM_Index blocks = (N + B - 1) / B;
+    static const SM_Index R = N - (blocks - 1) * B;
+    typedef typename SM_FixedIndex<N>::type I;
+    F &f;
+    void operator()(SM_Index s, SM_Index e) {
+        for (SM_Index k = s; k < e; ++k) {
+            I base = static_cast<I>(k * B);
+            if (k + 1 < blocks) sm_fixed_run<B>(f, base);
+            else sm_fixed_run<R>(f, base);
+        }
+    }
+};
+
+// 2D over M x N. Narrow rows (N up to a block's worth of indices): a block
+// is RB whole rows, the last one RR. Wide rows: each row is cut into SEGS
+// segments of CB columns (the last CR), block k is segment k mod SEGS of
+// row k / SEGS.
+template<SM_Index M, SM_Index N, typename F>
+struct SM_FixedBody2D {
+    static const SM_Index T = sm_fixed_block(M * N);
+    static const bool whole = N <= T;
+    static const SM_Index RB = whole ? T / N : 1;
+    static const SM_Index CB = whole ? N : T;
+    static const SM_Index SEGS = (N + CB - 1) / CB;
+    static const SM_Index blocks = whole ? (M + RB - 1) / RB : M * SEGS;
+    static const SM_Index RR = whole ? M - (blocks - 1) * RB : 1;
+    static const SM_Index CR = N - (SEGS - 1) * CB;
+    typedef typename SM_FixedIndex<(M > N ? M : N)>::type I;
+    F &f;
+
+    template<SM_Index C>
+    void row(I i, I j0) {
+        for (I j = 0; j < static_cast<I>(C); ++j) f(i, static_cast<I>(j0 + j));
+    }
+    template<SM_Index Rows>
+    void rows(I i0) {
+        for (I i = i0; i < static_cast<I>(i0 + Rows); ++i) row<N>(i, 0);
+    }
+    void block(SM_Index k, std::true_type) {
+        I i0 = static_cast<I>(k * RB);
+        if (k + 1 < blocks) rows<RB>(i0);
+        else rows<RR>(i0);
+    }
+    void block(SM_Index k, std::false_type) {
+        SM_Index i = SM_FixedWidth<SEGS>::div(k), seg = SM_FixedWidth<SEGS>::mod(k);
+        if (seg + 1 < SEGS) row<CB>(static_cast<I>(i), static_cast<I>(seg * CB));
+        else row<CR>(static_cast<I>(i), static_cast<I>(seg * CB));
+    }
+    void operator()(SM_Index s, SM_Index e) {
+        for (SM_Index k = s; k < e; ++k) block(k, std::integral_constant<bool, whole>());
+    }
+};
+
+// Public API - 1D over the fixed range [0, N): parallel_for<N>(lambda, numThreads)
+// calls lambda(i) like parallel_for(0, N, ...), with compile-time chunking
+// and unrolled chunk loops. The schedule splits the blocks.
+template<SM_Index N, typename F>
+inline void parallel_for(F &&lambda, int numThreads, SM_Schedule sched = SM_Schedule()) {
+    static_assert(N >= 0, "parallel_for<N>: N must not be negative");
+    typedef typename std::decay<F>::type LambdaType;
+    typedef SM_FixedBody<N, LambdaType> BodyType;
+    if (numThreads < 0) numThreads = 1;
+    if (N == 0) return;
+    LambdaType f(std::forward<F>(lambda));
+    BodyType body = {f};
+    sm_parallel_chunks(0, BodyType::blocks, body, numThreads, sched, "parallel_for<N>");
+}
+
+// Public API - 2D over the fixed space [0, M) x [0, N):
+// parallel_for<M, N>(lambda(i, j), numThreads). Blocks are whole rows or
+// row segments with constant column counts, so no index is divided by the
+// row width; the block number is split into (row, segment) by a constant
+// (shift and mask when the segment count is a power of two).
+template<SM_Index M, SM_Index N, typename F>
+inline void parallel_for(F &&lambda, int numThreads, SM_Schedule sched = SM_Schedule()) {
+    static_assert(M >= 0 && N >= 0, "parallel_for<M, N>: sizes must not be negative");
+    static_assert(N == 0 || M <= LLONG_MAX / N, "parallel_for<M, N>: 2D range too large");
+    typedef typename std::decay<F>::type LambdaType;
+    typedef SM_FixedBody2D<(M > 0 ? M : 1), (N > 0 ? N : 1), LambdaType> BodyType;
+    if (numThreads < 0) numThreads = 1;
+    if (M == 0 || N == 0) return;
+    LambdaType f(std::forward<F>(lambda));
+    BodyType body = {f};
+    sm_parallel_chunks(0, BodyType::blocks, body, numThreads, sched, "parallel_for<M,N>");
+}
+
+// Public API - 1D range: lambda(begin, end) is called once per thread with
+// that thread's whole slice of [low, high) (once per chunk under dynamic/guided)
+template<typename L, typename H, typename F>
+inline void parallel_for_range(L low_, H high_, F &&lambda, int numThreads,
+                               SM_Schedule sched = SM_Schedule()) {
+    typedef typename SM_IndexOf<L, H>::type I;
+    I low = static_cast<I>(low_), high = static_cast<I>(high_);
+    if (numThreads < 0) numThreads = 1;
+    if (low >= high) return;
+    SM_RangeBody<typename std::decay<F>::type, I> body(std::forward<F>(lambda));
+    sm_parallel_chunks(low, high, body, numThreads, sched, "parallel_for_range(1D)");
+}
+
+// Public API - 2D range: the space is cut into at most numThreads rectangular
+// tiles (row bands first, columns too when there are fewer rows than threads)
+// and lambda(i_begin, i_end, j_begin, j_end) is called once per tile.
+// With sm_schedule_tiled() the tiles are cache-sized instead and work-stolen.
+template<typename L1, typename H1, typename L2, typename H2, typename F>
+inline void parallel_for_range(L1 low1_, H1 high1_, L2 low2_, H2 high2_, F &&lambda, int numThreads,
+                               SM_Schedule sched = SM_Schedule()) {
+    typedef typename SM_IndexOf<L1, H1, L2, H2>::type I;
+    typedef typename std::decay<F>::type LambdaType;
+    I low1 = static_cast<I>(low1_), high1 = static_cast<I>(high1_);
+    I low2 = static_cast<I>(low2_), high2 = static_cast<I>(high2_);
+    if (numThreads < 0) numThreads = 1;
+    if (low1 >= high1 || low2 >= high2) return;
+    if (sched.kind == SM_SCHEDULE_TILED) {
+        int ti = sched.tile_i;
+        int tj = sched.tile_j;
+        sm_auto_tile(ti, tj);
+        SM_TileGrid<I> grid(low1, high1, low2, high2, ti, tj);
+        SM_GridBody2D<LambdaType, I> body(std::forward<F>(lambda), grid);
+        sm_parallel_chunks(0, grid.count(), body, numThreads, sm_schedule_steal(1), "parallel_for_range(2D tiled)");
+        return;
+    }
+    SM_Index rows = static_cast<SM_Index>(high1) - static_cast<SM_Index>(low1);
+    SM_Index cols = static_cast<SM_Index>(high2) - static_cast<SM_Index>(low2);
+    // the tile count depends on the thread count, so settle auto mode first
+    SM_AutoCall auto_call(sm_auto_site<SM_TileBody2D<LambdaType, I>>(), sm_area_2d(rows, cols), numThreads, sched);
+    int pr = static_cast<int>(std::min<SM_Index>(rows, numThreads));
+    int pc = static_cast<int>(std::max<SM_Index>(1, std::min<SM_Index>(cols, numThreads / pr)));
+    SM_TileBody2D<LambdaType, I> body(std::forward<F>(lambda), low1, high1, pr, low2, high2, pc);
+    sm_parallel_chunks(0, pr * pc, body, std::min(numThreads, pr * pc), sm_schedule_static(),
+                       "parallel_for_range(2D)");
+}
+
+// ---------------------------------------------------------------------------
+// parallel_reduce
+// ---------------------------------------------------------------------------
+
+// Per-thread partial result, alone on its cache line(s)
+template<typename T>
+struct alignas(SM_CACHE_LINE) SM_ReduceSlot {
+    T value;
+    explicit SM_ReduceSlot(const T &v) : value(v) {}
+};
+
+// Accumulators for one parallel_reduce call: slot 0 belongs to the calling
+// thread, slot w + 1 to pool worker w. A thread with no slot (a worker
+// started after the call began, or another caller helping out) merges into
+// a mutex-guarded overflow slot. Each chunk folds into a local first, so a
+// slot is touched once per chunk and only by its owner.
+template<typename T, typename Combine>
+class SM_ReduceSlots {
+public:
+    SM_ReduceSlots(const T &identity, int workers, Combine &combine)
+        : combine_(combine), count_(workers + 1), overflow_(identity), issuer_(&sm_ws_context()) {
+        slots_ = static_cast<SM_ReduceSlot<T> *>(scope_.arena.alloc(sizeof(SM_ReduceSlot<T>) * count_));
+        for (int k = 0; k < count_; ++k) new (&slots_[k]) SM_ReduceSlot<T>(identity);
+        pthread_mutex_init(&overflow_mtx_, nullptr);
+    }
+
+    ~SM_ReduceSlots() {
+        for (int k = 0; k < count_; ++k) slots_[k].~SM_ReduceSlot<T>();
+        pthread_mutex_destroy(&overflow_mtx_);
+    }
+
+    void merge(const T &partial) {
+        int k = sm_thread_slot(issuer_, count_);
+        if (k < count_) {
+            slots_[k].value = combine_(slots_[k].value, partial);
+        } else {
+            pthread_mutex_lock(&overflow_mtx_);
+            overflow_ = combine_(overflow_, partial);
+            pthread_mutex_unlock(&overflow_mtx_);
+        }
+    }
+
+    // fold every slot, in slot order, once all chunks have run
+    T result() {
+        T acc = slots_[0].value;
+        for (int k = 1; k < count_; ++k) acc = combine_(acc, slots_[k].value);
+        return combine_(acc, overflow_);
+    }
+
+private:
+    SM_ReduceSlots(const SM_ReduceSlots &) = delete;
+    SM_ReduceSlots &operator=(const SM_ReduceSlots &) = delete;
+
+    SM_ArenaScope scope_;            // slot storage, on the calling thread's arena
+    Combine &combine_;
+    SM_ReduceSlot<T> *slots_;
+    int count_;
+    T overflow_;
+    pthread_mutex_t overflow_mtx_;
+    const SM_WsContext *issuer_;
+};
+
+// 1D reduce body: fold map(i) over the chunk in a local, then merge once
+// (deterministic calls drive fold() per block instead and pass no slots)
+template<typename T, typename Map, typename Combine, typename I = int>
+struct SM_ReduceBody {
+    Map &map;
+    Combine &combine;
+    const T &identity;
+    SM_ReduceSlots<T, Combine> *slots;
+    SM_ReduceBody(Map &m, Combine &c, const T &id, SM_ReduceSlots<T, Combine> *sl)
+        : map(m), combine(c), identity(id), slots(sl) {}
+    T fold(SM_Index s, SM_Index e) {
+        T acc = identity;
+        I b = static_cast<I>(s);
+        I end = static_cast<I>(e);
+        for (I i = b; i < end; ++i) acc = combine(acc, map(i));
+        return acc;
+    }
+    void operator()(SM_Index s, SM_Index e) { slots->merge(fold(s, e)); }
+};
+
+// 2D reduce body over flattened slices, walked row by row like SM_FlatBody2D
+template<typename T, typename Map, typename Combine, typename I = int>
+struct SM_ReduceBody2D {
+    Map &map;
+    Combine &combine;
+    const T &identity;
+    SM_ReduceSlots<T, Combine> *slots;
+    I low1;
+    I low2;
+    SM_Index width2;
+    SM_ReduceBody2D(Map &m, Combine &c, const T &id, SM_ReduceSlots<T, Combine> *sl, I l1, I l2, SM_Index w)
+        : map(m), combine(c), identity(id), slots(sl), low1(l1), low2(l2), width2(w) {}
+    T fold(SM_Index s, SM_Index e) {
+        T acc = identity;
+        SM_Index w = width2;
+        I i = static_cast<I>(low1 + s / w);
+        SM_Index j0 = s % w;
+        SM_Index left = e - s;
+        while (left > 0) {
+            SM_Index n = std::min(w - j0, left);
+            I jb = static_cast<I>(low2 + j0);
+            I je = static_cast<I>(jb + n);
+            for (I j = jb; j < je; ++j) acc = combine(acc, map(i, j));
+            left -= n;
+            j0 = 0;
+            ++i;
+        }
+        return acc;
+    }
+    void operator()(SM_Index s, SM_Index e) { slots->merge(fold(s, e)); }
+};
+
+// Deterministic reduce: block k of the fixed split folds into partials[k]
+template<typename T, typename Fold>
+struct SM_BlockReduceBody {
+    Fold &fold;
+    T *partials;
+    SM_Index low;
+    SM_Index high;
+    int blocks;
+    SM_BlockReduceBody(Fold &f, T *p, SM_Index l, SM_Index h, int n)
+        : fold(f), partials(p), low(l), high(h), blocks(n) {}
+    void operator()(SM_Index kb, SM_Index ke) {
+        for (SM_Index k = kb; k < ke; ++k) {
+            SM_Index b, e;
+            sm_piece(low, high, blocks, static_cast<int>(k), b, e);
+            partials[k] = fold.fold(b, e);
+        }
+    }
+};
+
+// Combine p[0, n) pairwise in a fixed tree, (p0 p1) (p2 p3) ..., then
+// neighbouring pairs, keeping left-to-right order at every level
+template<typename T, typename Combine>
+T sm_tree_combine(T *p, SM_Index n, Combine &combine) {
+    for (SM_Index step = 1; step < n; step *= 2) {
+        for (SM_Index k = 0; k + step < n; k += 2 * step) p[k] = combine(p[k], p[k + step]);
+    }
+    return p[0];
+}
+
+// Internal driver: deterministic reduce of fold over [low, high). Blocks
+// are work-stolen one at a time (who runs a block does not affect the
+// result); the partials live in the calling thread's arena.
+template<typename T, typename Combine, typename Fold>
+T sm_reduce_deterministic(SM_Index low, SM_Index high, const T &identity, Fold &fold, Combine &combine,
+                          int numThreads, int requested, const char *label) {
+    int blocks = sm_deterministic_blocks(high - low, requested);
+    SM_ArenaScope scope;
+    T *partials = static_cast<T *>(scope.arena.alloc(sizeof(T) * blocks));
+    for (int k = 0; k < blocks; ++k) new (&partials[k]) T(identity);
+    struct Destroy {
+        T *p;
+        int n;
+        ~Destroy() {
+            for (int k = 0; k < n; ++k) p[k].~T();
+        }
+    } destroy = {partials, blocks};
+    SM_BlockReduceBody<T, Fold> body(fold, partials, low, high, blocks);
+    sm_parallel_chunks(0, blocks, body, numThreads, sm_schedule_steal(1), label);
+    return sm_tree_combine(partials, blocks, combine);
+}
+
+// Public API - 1D reduce: combine(identity, map(low), ..., map(high - 1)).
+// combine must be associative and commutative: partials are combined in
+// whatever order the threads finish their chunks. Under
+// sm_schedule_deterministic() the order is fixed (and combine need only be
+// associative), so the result is the same on every run and thread count.
+template<typename L, typename H, typename T, typename Map, typename Combine>
+inline T parallel_reduce(L low_, H high_, T identity, Map map, Combine combine, int numThreads,
+                         SM_Schedule sched = SM_Schedule()) {
+    typedef typename SM_IndexOf<L, H>::type I;
+    typedef SM_ReduceBody<T, Map, Combine, I> BodyType;
+    I low = static_cast<I>(low_), high = static_cast<I>(high_);
+    if (numThreads < 0) numThreads = 1;
+    if (low >= high) return identity;
+    if (sched.kind == SM_SCHEDULE_DETERMINISTIC) {
+        BodyType fold(map, combine, identity, nullptr);
+        return sm_reduce_deterministic(low, high, identity, fold, combine, numThreads, sched.chunk,
+                                       "parallel_reduce(1D)");
+    }
+    SM_ThreadPool &pool = SM_ThreadPool::instance();
+    pool.ensure_workers((numThreads > 0 ? numThreads : sm_cpu_count()) - 1);
+    SM_ReduceSlots<T, Combine> slots(identity, pool.size(), combine);
+    BodyType body(map, combine, identity, &slots);
+    sm_parallel_chunks(low, high, body, numThreads, sched, "parallel_reduce(1D)");
+    return slots.result();
+}
+
+// Public API - 2D reduce over [low1, high1) x [low2, high2) with map(i, j)
+template<typename L1, typename H1, typename L2, typename H2, typename T, typename Map, typename Combine>
+inline T parallel_reduce(L1 low1_, H1 high1_, L2 low2_, H2 high2_, T identity, Map map, Combine combine,
+                         int numThreads, SM_Schedule sched = SM_Schedule()) {
+    typedef typename SM_IndexOf<L1, H1, L2, H2>::type I;
+    typedef SM_ReduceBody2D<T, Map, Combine, I> BodyType;
+    I low1 = static_cast<I>(low1_), high1 = static_cast<I>(high1_);
+    I low2 = static_cast<I>(low2_), high2 = static_cast<I>(high2_);
+    if (numThreads < 0) numThreads = 1;
+    if (low1 >= high1 || low2 >= high2) return identity;
+    SM_Index cols = static_cast<SM_Index>(high2) - static_cast<SM_Index>(low2);
+    SM_Index total = sm_area_2d(static_cast<SM_Index>(high1) - static_cast<SM_Index>(low1), cols);
+    if (sched.kind == SM_SCHEDULE_DETERMINISTIC) {
+        BodyType fold(map, combine, identity, nullptr, low1, low2, cols);
+        return sm_reduce_deterministic(0, total, identity, fold, combine, numThreads, sched.chunk,
+                                       "parallel_reduce(2D)");
+    }
+    SM_ThreadPool &pool = SM_ThreadPool::instance();
+    pool.ensure_workers((numThreads > 0 ? numThreads : sm_cpu_count()) - 1);
+    SM_ReduceSlots<T, Combine> slots(identity, pool.size(), combine);
+    BodyType body(map, combine, identity, &slots, low1, low2, cols);
+    sm_parallel_chunks(0, total, body, numThreads, sched, "parallel_reduce(2D)");
+    return slots.result();
+}
+
+// ---------------------------------------------------------------------------
+// parallel_scan
+// ---------------------------------------------------------------------------
+
+// numThreads 0: ranges shorter than this scan serially, longer ones use
+// every CPU
+#ifndef SM_SCAN_SERIAL_INDICES
+#define SM_SCAN_SERIAL_INDICES (1 << 16)
+#endif
+
+// Element type a scan reads from `in`
+template<typename In>
+struct SM_ScanValue {
+    typedef typename std::decay<decltype(std::declval<In &>()[0])>::type type;
+};
+
+// Chunk kernels of a scan over in[b, e) -> out[b, e). reduce folds the chunk
+// from in[b]; scan writes carry op in[b] op ... op in[i] (inclusive) or the
+// same without in[i] (exclusive) and returns the carry past the chunk. With
+// no carry (the first chunk of an inclusive scan) the chunk starts at in[b].
+template<typename T, typename In, typename Out, typename Op>
+struct SM_ScanGeneric {
+    static T reduce(In in, SM_Index b, SM_Index e, Op &op) {
+        T acc = in[b];
+        for (SM_Index i = b + 1; i < e; ++i) acc = op(acc, in[i]);
+        return acc;
+    }
+    static T scan(In in, Out out, SM_Index b, SM_Index e, T carry, bool has_carry, bool exclusive, Op &op) {
+        SM_Index i = b;
+        if (!has_carry) {
+            carry = in[i];
+            out[i++] = carry;
+        }
+        if (exclusive) {
+            for (; i < e; ++i) {
+                T v = in[i];
+                out[i] = carry;
+                carry = op(carry, v);
+            }
+        } else {
+            for (; i < e; ++i) {
+                carry = op(carry, in[i]);
+                out[i] = carry;
+            }
+        }
+        return carry;
+    }
+};
+
+template<typename T, typename In, typename Out, typename Op>
+struct SM_ScanKernel : SM_ScanGeneric<T, In, Out, Op> {};
+
+#if defined(__SSE2__)
+// std::plus over arithmetic arrays: 16-byte vectors are prefix-summed in
+// registers with log2(16 / sizeof(T)) shift-and-add steps, and the chunk
+// sum uses vector accumulators. Sums are reassociated, as across chunks.
+template<typename T, bool = std::is_arithmetic<T>::value && !std::is_same<T, bool>::value && sizeof(T) <= 8>
+struct SM_ScanPlus : SM_ScanGeneric<T, const T *, T *, std::plus<T>> {};
+
+template<typename T>
+struct SM_ScanPlus<T, true> {
+    typedef T V __attribute__((vector_size(16)));
+    static const int VL = 16 / sizeof(T);
+
+    // lanes moved up by K bytes, zeros shifted in
+    template<int K>
+    static V shift(V x) { return (V)_mm_slli_si128((__m128i)x, K); }
+
+    static V prefix(V x) {
+        if (sizeof(T) == 1) x += shift<1>(x);
+        if (sizeof(T) <= 2) x += shift<2>(x);
+        if (sizeof(T) <= 4) x += shift<4>(x);
+        return x + shift<8>(x);
+    }
+
+    static T reduce(const T *in, SM_Index b, SM_Index e, std::plus<T> &) {
+        V acc = V();
+        SM_Index i = b;
+        for (; i + VL <= e; i += VL) {
+            V x;
+            memcpy(&x, in + i, 16);
+            acc += x;
+        }
+        T sum = T(0);
+        for (int l = 0; l < VL; ++l) sum += acc[l];
+        for (; i < e; ++i) sum += in[i];
+        return sum;
+    }
+
+    static T scan(const T *in, T *out, SM_Index b, SM_Index e, T carry, bool has_carry, bool exclusive,
+                  std::plus<T> &) {
+        if (!has_carry) carry = T(0);
+        SM_Index i = b;
+        for (; i + VL <= e; i += VL) {
+            V x;
+            memcpy(&x, in + i, 16);
+            V inc = prefix(x);
+            V res = exclusive ? shift<sizeof(T)>(inc) + carry : inc + carry;
+            carry += inc[VL - 1];
+            memcpy(out + i, &res, 16);
+        }
+        for (; i < e; ++i) {
+            T v = in[i];
+            if (exclusive) out[i] = carry;
+            carry += v;
+            if (!exclusive) out[i] = carry;
+        }
+        return carry;
+    }
+};
+
+template<typename T>
+struct SM_ScanKernel<T, const T *, T *, std::plus<T>> : SM_ScanPlus<T> {};
+template<typename T>
+struct SM_ScanKernel<T, T *, T *, std::plus<T>> : SM_ScanPlus<T> {
+    static T reduce(T *in, SM_Index b, SM_Index e, std::plus<T> &op) {
+        return SM_ScanPlus<T>::reduce(in, b, e, op);
+    }
+    static T scan(T *in, T *out, SM_Index b, SM_Index e, T carry, bool has_carry, bool exclusive, std::plus<T> &op) {
+        return SM_ScanPlus<T>::scan(in, out, b, e, carry, has_carry, exclusive, op);
+    }
+};
+#endif
+
+// Pass 1: chunk c of the static split folds into sums[c]
+template<typename T, typename In, typename Out, typename Op>
+struct SM_ScanUpBody {
+    In in;
+    Op &op;
+    T *sums;
+    SM_Index low, high;
+    int chunks;
+    void operator()(SM_Index cb, SM_Index ce) {
+        for (SM_Index c = cb; c < ce; ++c) {
+            SM_Index b, e;
+            sm_piece(low, high, chunks, static_cast<int>(c), b, e);
+            sums[c] = SM_ScanKernel<T, In, Out, Op>::reduce(in, b, e, op);
+        }
+    }
+};
+
+// Pass 2: chunk c scans again from carries[c]; the last chunk's carry out
+// is the total
+template<typename T, typename In, typename Out, typename Op>
+struct SM_ScanDownBody {
+    In in;
+    Out out;
+    Op &op;
+    T *carries;
+    bool has_init;
+    bool exclusive;
+    SM_Index low, high;
+    int chunks;
+    void operator()(SM_Index cb, SM_Index ce) {
+        for (SM_Index c = cb; c < ce; ++c) {
+            SM_Index b, e;
+            sm_piece(low, high, chunks, static_cast<int>(c), b, e);
+            T carry = SM_ScanKernel<T, In, Out, Op>::scan(in, out, b, e, carries[c], c > 0 || has_init, exclusive, op);
+            if (c == chunks - 1) carries[chunks] = carry;
+        }
+    }
+};
+
+// Internal driver: blocked two-pass scan over one static chunk per thread.
+// Pass 1 reduces each chunk, the chunk sums are scanned serially into
+// carries, and pass 2 rescans each chunk from its carry on the same thread,
+// so in is read twice and out written once. Writes to carries[chunks] come
+// only from the last chunk.
+template<typename T, typename In, typename Out, typename Op>
+T sm_scan(SM_Index low, SM_Index high, In in, Out out, Op &op, int numThreads, bool exclusive, const T *init) {
+    typedef SM_ScanKernel<T, In, Out, Op> Kernel;
+    SM_Index n = high - low;
+    if (numThreads < 0) numThreads = 1;
+    if (numThreads == 0) numThreads = n < SM_SCAN_SERIAL_INDICES ? 1 : sm_cpu_count();
+    int chunks = static_cast<int>(std::min<SM_Index>(numThreads, n));
+    if (chunks <= 1) return Kernel::scan(in, out, low, high, init ? *init : T(in[low]), init != nullptr, exclusive, op);
+
+    SM_ArenaScope scope;
+    T *sums = static_cast<T *>(scope.arena.alloc(sizeof(T) * (2 * chunks + 1)));
+    T *carries = sums + chunks;
+    for (int k = 0; k < 2 * chunks + 1; ++k) new (&sums[k]) T(in[low]);
+    struct Destroy {
+        T *p;
+        int n;
+        ~Destroy() {
+            for (int k = 0; k < n; ++k) p[k].~T();
+        }
+    } destroy = {sums, 2 * chunks + 1};
+
+    SM_ScanUpBody<T, In, Out, Op> up = {in, op, sums, low, high, chunks};
+    sm_parallel_chunks(0, chunks, up, chunks, sm_schedule_static(), "parallel_scan(up)");
+    if (init) carries[0] = *init;
+    for (int c = 1; c < chunks; ++c) carries[c] = c > 1 || init ? op(carries[c - 1], sums[c - 1]) : sums[0];
+    SM_ScanDownBody<T, In, Out, Op> down = {in, out, op, carries, init != nullptr, exclusive, low, high, chunks};
+    sm_parallel_chunks(0, chunks, down, chunks, sm_schedule_static(), "parallel_scan(down)");
+    return carries[chunks];
+}
+
+// Public API - inclusive scan: out[i] = in[low] op in[low + 1] op ... op in[i]
+// for i in [low, high); returns the total. op must be associative. in and out
+// are indexed directly (pointers or random-access iterators) and may alias.
+// With std::plus<T>() over arithmetic arrays the chunks are scanned with SIMD.
+// numThreads 0 scans short ranges serially and long ones on every CPU.
+template<typename L, typename H, typename In, typename Out, typename Op>
+inline typename SM_ScanValue<In>::type parallel_scan(L low_, H high_, In in, Out out, Op op, int numThreads) {
+    typedef typename SM_ScanValue<In>::type T;
+    typedef typename SM_IndexOf<L, H>::type I;
+    I low = static_cast<I>(low_), high = static_cast<I>(high_);
+    if (low >= high) return T();
+    return sm_scan<T>(low, high, in, out, op, numThreads, false, static_cast<const T *>(nullptr));
+}
+
+// Public API - exclusive scan: out[i] = init op in[low] op ... op in[i - 1]
+// (out[low] = init); returns init combined with every element
+template<typename L, typename H, typename In, typename Out, typename T, typename Op>
+inline T parallel_exclusive_scan(L low_, H high_, In in, Out out, T init, Op op, int numThreads) {
+    typedef typename SM_IndexOf<L, H>::type I;
+    I low = static_cast<I>(low_), high = static_cast<I>(high_);
+    if (low >= high) return init;
+    return sm_scan<T>(low, high, in, out, op, numThreads, true, &init);
+}
+
+// ---------------------------------------------------------------------------
+// parallel_for_async
+// ---------------------------------------------------------------------------
+
+// Shared state of an asynchronous call: a one-task group for the pool worker
+// driving the call, the call's exception, and (for when_all) the parts.
+struct SM_AsyncState {
+    SM_TaskGroup group;
+    std::exception_ptr error;
+    std::vector<std::shared_ptr<SM_AsyncState>> parts;
+};
+
+// Waitable handle to an asynchronous parallel_for (or to a when_all of
+// several). Copies refer to the same call. Dropping every handle does not
+// cancel or wait for the call, so keep one until the data it touches is done.
+class SM_Async {
+public:
+    SM_Async() {}
+    explicit SM_Async(std::shared_ptr<SM_AsyncState> st) : state_(st) {}
+
+    bool valid() const { return state_ != nullptr; }
+
+    // true once the call (every part, for when_all) has finished
+    bool ready() const { return !state_ || ready(*state_); }
+
+    // Block until finished; rethrows the first exception of the call. A pool
+    // worker waiting here keeps running other work meanwhile.
+    void wait() const {
+        if (!state_) return;
+        wait_until(*state_, -1);
+        rethrow(*state_);
+    }
+
+    // Wait at most `timeout`; true if finished (then rethrows like wait())
+    template<typename Rep, typename Period>
+    bool wait_for(const std::chrono::duration<Rep, Period> &timeout) const {
+        if (!state_) return true;
+        long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+        if (!wait_until(*state_, sm_now_ns() + std::max(0LL, ns))) return false;
+        rethrow(*state_);
+        return true;
+    }
+
+    const std::shared_ptr<SM_AsyncState> &state() const { return state_; }
+
+private:
+    static bool ready(const SM_AsyncState &st) {
+        if (st.group.pending.load(std::memory_order_acquire) > 0) return false;
+        for (const std::shared_ptr<SM_AsyncState> &p : st.parts)
+            if (!ready(*p)) return false;
+        return true;
+    }
+
+    static bool wait_until(SM_AsyncState &st, long long deadline_ns) {
+        if (!SM_ThreadPool::instance().wait(st.group, deadline_ns)) return false;
+        for (const std::shared_ptr<SM_AsyncState> &p : st.parts)
+            if (!wait_until(*p, deadline_ns)) return false;
+        return true;
+    }
+
+    static void rethrow(const SM_AsyncState &st) {
+        if (st.error) std::rethrow_exception(st.error);
+        for (const std::shared_ptr<SM_AsyncState> &p : st.parts) rethrow(*p);
+    }
+
+    std::shared_ptr<SM_AsyncState> state_;
+};
+
+template<typename Launch>
+struct SM_AsyncTask : SM_PoolTask {
+    std::shared_ptr<SM_AsyncState> state;
+    Launch launch;
+    SM_JobOptions options;  // the launching thread's, reapplied on the driver
+    SM_AsyncTask(std::shared_ptr<SM_AsyncState> st, Launch &&l)
+        : state(st), launch(std::move(l)), options(sm_job_options()) {}
+};
+
+// Posted outside any group: the handles may all be gone by the time the
+// call finishes, so the task keeps the state alive until it has signalled it.
+template<typename Launch>
+void sm_async_entry(SM_PoolTask *t) {
+    auto *task = static_cast<SM_AsyncTask<Launch> *>(t);
+    std::shared_ptr<SM_AsyncState> st = task->state;
+    try {
+        SM_JobScope scope(task->options.priority, task->options.max_workers);
+        task->launch();
+    } catch (...) {
+        st->error = std::current_exception();
+    }
+    delete task;
+    SM_ThreadPool::instance().complete(st->group);
+}
+
+// Hand the task driving a blocking call to a pool worker, which then plays
+// the caller's part (runs the last piece, steals, waits). The driver is
+// worker numThreads - 1, so static pieces 0..numThreads-2 keep their usual
+// workers.
+inline void sm_post_driver(SM_PoolTask *task, int numThreads, SM_Priority prio) {
+    int driver = (numThreads > 0 ? numThreads : sm_cpu_count()) - 1;
+    SM_ThreadPool &pool = SM_ThreadPool::instance();
+    pool.ensure_workers(driver + 1);
+    pool.post(driver, task, prio);
+    pool.flush();
+}
+
+template<typename Launch>
+SM_Async sm_launch_async(Launch &&launch, int numThreads) {
+    std::shared_ptr<SM_AsyncState> st = std::make_shared<SM_AsyncState>();
+    typedef typename std::decay<Launch>::type LaunchType;
+    auto *task = new SM_AsyncTask<LaunchType>(st, std::forward<Launch>(launch));
+    task->run = sm_async_entry<LaunchType>;
+    st->group.pending.store(1, std::memory_order_relaxed);
+    sm_post_driver(task, numThreads, task->options.priority);
+    return SM_Async(st);
+}
+
+// Public API - 1D parallel_for that returns immediately; the loop runs on the
+// pool and the handle reports completion
+template<typename L, typename H, typename F>
+inline SM_Async parallel_for_async(L low, H high, F &&lambda, int numThreads,
+                                   SM_Schedule sched = SM_Schedule()) {
+    typename std::decay<F>::type fn(std::forward<F>(lambda));
+    return sm_launch_async([=]() mutable { parallel_for(low, high, std::move(fn), numThreads, sched); },
+                           numThreads);
+}
+
+// Public API - 2D parallel_for_async
+template<typename L1, typename H1, typename L2, typename H2, typename F>
+inline SM_Async parallel_for_async(L1 low1, H1 high1, L2 low2, H2 high2, F &&lambda, int numThreads,
+                                   SM_Schedule sched = SM_Schedule()) {
+    typename std::decay<F>::type fn(std::forward<F>(lambda));
+    return sm_launch_async([=]() mutable {
+        parallel_for(low1, high1, low2, high2, std::move(fn), numThreads, sched);
+    }, numThreads);
+}
+
+// A handle that is ready once every given handle is; wait() rethrows the
+// first exception in argument order
+inline SM_Async when_all(const std::vector<SM_Async> &handles) {
+    std::shared_ptr<SM_AsyncState> st = std::make_shared<SM_AsyncState>();
+    for (const SM_Async &h : handles)
+        if (h.valid()) st->parts.push_back(h.state());
+    return SM_Async(st);
+}
+
+template<typename... Handles>
+inline SM_Async when_all(const SM_Async &first, const Handles &... rest) {
+    return when_all(std::vector<SM_Async>{first, rest...});
+}
+
+#if SM_COROUTINES
+// ---------------------------------------------------------------------------
+// parallel_for_co (C++20)
+// ---------------------------------------------------------------------------
+
+// Awaitable for one loop. Suspending posts the awaiter itself, which stays
+// in the coroutine frame until resumed, as the driver task of the loop, so
+// a co_await allocates nothing and blocks no thread. The worker that
+// finishes the loop resumes the coroutine.
+template<typename Launch>
+class SM_LoopAwaiter : SM_PoolTask {
+public:
+    SM_LoopAwaiter(Launch launch, int numThreads)
+        : launch_(std::move(launch)), numThreads_(numThreads), options_(sm_job_options()) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        run = &SM_LoopAwaiter::entry;
+        sm_post_driver(this, numThreads_, options_.priority);
+    }
+
+    // rethrows the loop's first exception
+    void await_resume() {
+        if (error_) std::rethrow_exception(error_);
+    }
+
+private:
+    static void entry(SM_PoolTask *t) {
+        SM_LoopAwaiter *self = static_cast<SM_LoopAwaiter *>(t);
+        try {
+            SM_JobScope scope(self->options_.priority, self->options_.max_workers);
+            self->launch_();
+        } catch (...) {
+            self->error_ = std::current_exception();
+        }
+        self->handle_.resume(); // may destroy *self
+    }
+
+    Launch launch_;
+    int numThreads_;
+    SM_JobOptions options_;
+    std::coroutine_handle<> handle_;
+    std::exception_ptr error_;
+};
+
+namespace sm {
+
+// Public API - co_await sm::parallel_for_co(low, high, lambda, numThreads [, sched])
+// inside a coroutine: the loop runs on the pool while the awaiting thread
+// goes on with other work (an event loop, say), and the coroutine continues
+// on the pool worker that finished the loop. Resume on your own executor
+// afterwards if the rest of the coroutine must run there.
+template<typename L, typename H, typename F>
+inline auto parallel_for_co(L low, H high, F &&lambda, int numThreads, SM_Schedule sched = SM_Schedule()) {
+    typename std::decay<F>::type fn(std::forward<F>(lambda));
+    auto launch = [=]() mutable { ::parallel_for(low, high, fn, numThreads, sched); };
+    return SM_LoopAwaiter<decltype(launch)>(std::move(launch), numThreads);
+}
+
+// Public API - 2D parallel_for_co
+template<typename L1, typename H1, typename L2, typename H2, typename F>
+inline auto parallel_for_co(L1 low1, H1 high1, L2 low2, H2 high2, F &&lambda, int numThreads,
+                            SM_Schedule sched = SM_Schedule()) {
+    typename std::decay<F>::type fn(std::forward<F>(lambda));
+    auto launch = [=]() mutable { ::parallel_for(low1, high1, low2, high2, fn, numThreads, sched); };
+    return SM_LoopAwaiter<decltype(launch)>(std::move(launch), numThreads);
+}
+
+} // namespace sm
+#endif // SM_COROUTINES
+
+// ---------------------------------------------------------------------------
+// Independent tasks: SM_TaskSet and parallel_invoke
+// ---------------------------------------------------------------------------
+
+// How a callable of type F sits in a queue slot: in place when it fits,
+// else as a pointer to a heap copy. A submit first builds a Held (F
+// itself, or its heap box), which may throw, and only then claims a slot,
+// where construct() moves the Held in without throwing.
+template<typename F, bool Inline = (sizeof(F) <= SM_TASK_INLINE_BYTES && alignof(F) <= 16 &&
+                                   std::is_nothrow_move_constructible<F>::value)>
+struct SM_TaskStorage {
+    typedef F Held;
+    static F &target(Held &held) { return held; }
+    static void construct(void *at, Held &held) noexcept { new (at) F(std::move(held)); }
+    static F &get(void *at) { return *static_cast<F *>(at); }
+    static void destroy(void *at) { get(at).~F(); }
+    static void move(void *from, void *to) {
+        new (to) F(std::move(get(from)));
+        destroy(from);
+    }
+};
+
+template<typename F>
+struct SM_TaskStorage<F, false> {
+    struct Held {
+        std::unique_ptr<F> box;
+        template<typename G>
+        explicit Held(G &&f) : box(new F(std::forward<G>(f))) {}
+    };
+    static F &target(Held &held) { return *held.box; }
+    static void construct(void *at, Held &held) noexcept { *static_cast<F **>(at) = held.box.release(); }
+    static F &get(void *at) { return **static_cast<F **>(at); }
+    static void destroy(void *at) { delete *static_cast<F **>(at); }
+    static void move(void *from, void *to) { *static_cast<F **>(to) = *static_cast<F **>(from); }
+};
+
+// A set of independent tasks on the pool:
+//   SM_TaskSet tasks; tasks.submit([&] { a(); }); tasks.submit([&] { b(); }); tasks.wait();
+// Tasks go through the pool's lock-free task queue and run on any worker,
+// or on a thread waiting in wait(), roughly in submission order. A submit
+// takes no lock and, for callables up to SM_TASK_INLINE_BYTES, allocates
+// nothing; when the queue is full the task runs on the submitting thread.
+// The set is the tasks' enclosing call: the first exception cancels the
+// tasks not yet started and is rethrown by wait(), sm_cancel() in a task
+// does the same without an error, and parallel calls issued by a task nest
+// under the set (and take its SM_JobScope options). The destructor waits.
+class SM_TaskSet {
+public:
+    SM_TaskSet() : ctl_(sm_current_call()) { group_.pending.store(0, std::memory_order_relaxed); }
+    ~SM_TaskSet() { SM_ThreadPool::instance().wait(group_); }
+
+    template<typename F>
+    void submit(F &&f) {
+        typedef typename std::decay<F>::type Fn;
+        SM_ThreadPool &pool = SM_ThreadPool::instance();
+        pool.ensure_workers(sm_cpu_count() - 1);
+        // copy (or box) before claiming a slot: a throw here leaves the queue untouched
+        typename SM_TaskStorage<Fn>::Held held(std::forward<F>(f));
+        group_.pending.fetch_add(1, std::memory_order_relaxed);
+        if (!pool.push_task(&SM_TaskSet::op<Fn>, this,
+                            [&](void *at) { SM_TaskStorage<Fn>::construct(at, held); })) {
+            run_here(SM_TaskStorage<Fn>::target(held));
+            pool.complete(group_);
+        }
+    }
+
+    // Run f on this thread as one of the set's tasks
+    template<typename F>
+    void run_here(F &f) {
+        if (ctl_.is_cancelled()) return;
+        SM_CallControl *&current = sm_current_call();
+        SM_CallControl *outer = current;
+        current = &ctl_;
+        try {
+            f();
+        } catch (...) {
+            ctl_.fail(std::current_exception());
+        }
+        current = outer;
+    }
+
+    // Wait for every task submitted so far, helping with the queue, and
+    // rethrow the first exception
+    void wait() {
+        SM_ThreadPool::instance().wait(group_);
+        if (ctl_.error) std::rethrow_exception(ctl_.error);
+    }
+
+private:
+    SM_TaskSet(const SM_TaskSet &) = delete;
+    SM_TaskSet &operator=(const SM_TaskSet &) = delete;
+
+    template<typename Fn>
+    static void op(SM_TaskOpKind kind, void *storage, void *arg) {
+        if (kind == SM_TASK_MOVE) {
+            SM_TaskStorage<Fn>::move(storage, arg);
+            return;
+        }
+        SM_TaskSet *set = static_cast<SM_TaskSet *>(arg);
+        set->run_here(SM_TaskStorage<Fn>::get(storage));
+        SM_TaskStorage<Fn>::destroy(storage);
+        SM_ThreadPool::instance().complete(set->group_);
+    }
+
+    SM_TaskGroup group_;
+    SM_CallControl ctl_;
+};
+
+// A queued reference to one of parallel_invoke's arguments, which stay on
+// the caller's stack until every task is done
+template<typename F>
+struct SM_InvokeRef {
+    F *f;
+    void operator()() { (*f)(); }
+};
+
+// Public API - run f1, f2, ... concurrently and return once all are done.
+// f2 ... fn are queued as tasks and f1 runs on the caller, which then helps
+// with the queue; the first exception is rethrown here.
+template<typename F1, typename... Fs>
+inline void parallel_invoke(F1 &&f1, Fs &&... fs) {
+    SM_TaskSet tasks;
+    int queued[] = {0, (tasks.submit(SM_InvokeRef<typename std::remove_reference<Fs>::type>{&fs}), 0)...};
+    (void)queued;
+    tasks.run_here(f1);
+    tasks.wait();
+}
+
+// ---------------------------------------------------------------------------
+// SM_Pipeline: parallel loops chained at chunk granularity
+// ---------------------------------------------------------------------------
+
+// A set of 1D loops ("stages") cut into fixed chunks, where each chunk starts
+// as soon as the chunks it depends on have finished rather than after a
+// barrier on the whole previous stage. A stage may only depend on stages
+// added before it. Typical use, with row i of C needing row i of A and all
+// of B:
+//   SM_Pipeline p(8);
+//   int a = p.stage(0, n, [&](int i) { init_row(A, i); });
+//   int b = p.stage(0, n, [&](int i) { init_row(B, i); });
+//   int c = p.stage(0, n, [&](int i) { multiply_row(C, A, B, i); });
+//   p.depend_same(c, a);
+//   p.depend_all(c, b);
+//   p.run();
+// Chunks of a stage are spread over the threads by position, the same way
+// for every stage and as a static parallel_for splits the range (band t on
+// worker t, the last band on the caller), so row band k of every stage runs
+// on the same thread that first touched it.
+class SM_Pipeline {
+public:
+    typedef std::function<std::pair<SM_Index, SM_Index>(SM_Index, SM_Index)> Need;
+
+    // numThreads == 0 uses every available CPU
+    explicit SM_Pipeline(int numThreads)
+        : threads_(numThreads > 0 ? numThreads : sm_cpu_count()), workers_(threads_), ctl_(nullptr) {}
+
+    // Add a stage running lambda(i) over [low, high) in chunks of `chunk`
+    // indices (0: about 8 chunks per thread); returns the stage id
+    template<typename L, typename H, typename F>
+    int stage(L low_, H high_, F &&lambda, SM_Index chunk = 0) {
+        typedef typename SM_IndexOf<L, H>::type I;
+        Stage st;
+        st.low = static_cast<I>(low_);
+        st.high = std::max(st.low, static_cast<SM_Index>(static_cast<I>(high_)));
+        st.chunk = chunk > 0 ? chunk : std::max<SM_Index>(1, (st.high - st.low) / (8LL * threads_));
+        st.body = SM_IndexBody<typename std::decay<F>::type, I>(std::forward<F>(lambda));
+        stages_.push_back(std::move(st));
+        return static_cast<int>(stages_.size()) - 1;
+    }
+
+    // chunk [b, e) of `stage` waits for indices [b, e) of `on`
+    void depend_same(int stage, int on) {
+        add_dep(stage, on, DEP_RANGE, [](SM_Index b, SM_Index e) { return std::make_pair(b, e); });
+    }
+
+    // every chunk of `stage` waits for all of `on` (a barrier on this edge only)
+    void depend_all(int stage, int on) { add_dep(stage, on, DEP_ALL, Need()); }
+
+    // chunk [b, e) of `stage` waits for indices need(b, e) = [nb, ne) of `on`
+    void depend(int stage, int on, Need need) { add_dep(stage, on, DEP_RANGE, std::move(need)); }
+
+    // Run every stage to completion; rethrows the first exception of any
+    // chunk (chunks not yet started are then skipped). Can be run again.
+    void run() {
+        SM_CallControl ctl(sm_current_call());
+        workers_ = threads_;
+        if (ctl.options.max_workers >= 0) workers_ = std::min(workers_, ctl.options.max_workers + 1);
+        build();
+        if (chunks_.empty()) return;
+        ctl_ = &ctl;
+#if SM_INSTRUMENTATION
+        SM_Observer *obs = sm_get_observer();
+        std::unique_ptr<SM_CallRecorder> rec(obs || sm_tracing() ? new SM_CallRecorder("pipeline", workers_) : nullptr);
+        rec_ = rec.get();
+#endif
+        if (workers_ > 1) {
+            SM_ThreadPool::instance().ensure_workers(workers_ - 1);
+            group_.pending.store(0, std::memory_order_relaxed);
+        }
+        std::vector<int> ready, local;
+        for (int c = 0; c < static_cast<int>(chunks_.size()); ++c)
+            if (waiting_[c].load(std::memory_order_relaxed) == 0) ready.push_back(c);
+        // the caller runs the last band, as in sm_run_pieces
+        route(ready, workers_ - 1, local);
+        run_chain(local, workers_ - 1);
+        if (workers_ > 1) SM_ThreadPool::instance().wait(group_);
+#if SM_INSTRUMENTATION
+        if (rec) rec->finish(obs);
+        rec_ = nullptr;
+#endif
+        ctl_ = nullptr;
+        if (ctl.error) std::rethrow_exception(ctl.error);
+    }
+
+private:
+    SM_Pipeline(const SM_Pipeline &) = delete;
+    SM_Pipeline &operator=(const SM_Pipeline &) = delete;
+
+    enum DepKind { DEP_RANGE, DEP_ALL };
+
+    struct Dep {
+        int on;
+        DepKind kind;
+        Need need;
+    };
+
+    struct Stage {
+        SM_Index low, high, chunk;
+        std::function<void(SM_Index, SM_Index)> body;
+        std::vector<Dep> deps;
+        int first;                         // id of its first chunk
+        int count;                         // number of chunks
+        std::vector<int> all_dependents;   // stages with a depend_all on this one
+    };
+
+    struct Chunk : SM_PoolTask {
+        SM_Pipeline *pipeline;
+        int id;
+        int stage;
+        int worker;                        // band: pool worker, the last is the caller
+    };
+
+    void add_dep(int stage, int on, DepKind kind, Need need) {
+        if (stage < 0 || stage >= static_cast<int>(stages_.size()) || on < 0 || on >= stage)
+            throw std::invalid_argument("SM_Pipeline: a stage can only depend on an earlier stage");
+        Dep d;
+        d.on = on;
+        d.kind = kind;
+        d.need = std::move(need);
+        stages_[stage].deps.push_back(std::move(d));
+    }
+
+    // Lay out the chunks and turn the dependencies into per-chunk wait
+    // counts plus successor lists (CSR). depend_all edges are counted once
+    // per chunk and released when the whole producer stage is done.
+    void build() {
+        int total = 0;
+        for (Stage &st : stages_) {
+            st.first = total;
+            st.count = static_cast<int>((st.high - st.low + st.chunk - 1) / st.chunk);
+            st.all_dependents.clear();
+            total += st.count;
+        }
+        chunks_.assign(total, Chunk());
+        waiting_.reset(new std::atomic<int>[total]);
+        stage_left_.reset(new std::atomic<int>[stages_.size()]);
+        std::vector<std::vector<int>> succ(total);
+        for (int s = 0; s < static_cast<int>(stages_.size()); ++s) {
+            Stage &st = stages_[s];
+            stage_left_[s].store(st.count, std::memory_order_relaxed);
+            for (int k = 0; k < st.count; ++k) {
+                int c = st.first + k;
+                chunks_[c].run = &SM_Pipeline::chunk_entry;
+                chunks_[c].pipeline = this;
+                chunks_[c].id = c;
+                chunks_[c].stage = s;
+                chunks_[c].worker = static_cast<int>((static_cast<long long>(k) * workers_) / st.count);
+                int wait = 0;
+                SM_Index b = st.low + k * st.chunk;
+                SM_Index e = std::min(b + st.chunk, st.high);
+                for (const Dep &d : st.deps) {
+                    const Stage &up = stages_[d.on];
+                    if (up.count == 0) continue;
+                    if (d.kind == DEP_ALL) {
+                        if (k == 0) stages_[d.on].all_dependents.push_back(s);
+                        ++wait;
+                        continue;
+                    }
+                    std::pair<SM_Index, SM_Index> r = d.need(b, e);
+                    SM_Index nb = std::max(r.first, up.low);
+                    SM_Index ne = std::min(r.second, up.high);
+                    if (nb >= ne) continue;
+                    int p0 = static_cast<int>((nb - up.low) / up.chunk);
+                    int p1 = static_cast<int>((ne - 1 - up.low) / up.chunk);
+                    for (int p = p0; p <= p1; ++p) succ[up.first + p].push_back(c);
+                    wait += p1 - p0 + 1;
+                }
+                waiting_[c].store(wait, std::memory_order_relaxed);
+            }
+        }
+        succ_begin_.assign(total + 1, 0);
+        succ_.clear();
+        for (int c = 0; c < total; ++c) {
+            succ_.insert(succ_.end(), succ[c].begin(), succ[c].end());
+            succ_begin_[c + 1] = static_cast<int>(succ_.size());
+        }
+    }
+
+    void execute(int c) {
+        if (ctl_->is_cancelled()) return;
+        Stage &st = stages_[chunks_[c].stage];
+        SM_Index b = st.low + static_cast<SM_Index>(c - st.first) * st.chunk;
+        SM_Index e = std::min(b + st.chunk, st.high);
+        SM_CallControl *&current = sm_current_call();
+        SM_CallControl *outer = current;
+        current = ctl_;
+        auto run = [&] {
+            try {
+                st.body(b, e);
+            } catch (...) {
+                ctl_->fail(std::current_exception());
+            }
+        };
+#if SM_INSTRUMENTATION
+        if (rec_) rec_->measure(b, e, run);
+        else run();
+#else
+        run();
+#endif
+        current = outer;
+    }
+
+    void release(int c, std::vector<int> &ready) {
+        if (waiting_[c].fetch_sub(1, std::memory_order_acq_rel) == 1) ready.push_back(c);
+    }
+
+    // Mark chunk c done and collect the chunks that became ready
+    void complete(int c, std::vector<int> &ready) {
+        for (int k = succ_begin_[c]; k < succ_begin_[c + 1]; ++k) release(succ_[k], ready);
+        int s = chunks_[c].stage;
+        if (stage_left_[s].fetch_sub(1, std::memory_order_acq_rel) == 1)
+            for (int d : stages_[s].all_dependents)
+                for (int k = 0; k < stages_[d].count; ++k) release(stages_[d].first + k, ready);
+    }
+
+    // Chunks of band `home` (the running thread's) and of the caller's band
+    // go onto `local`; the others go to their workers' mailboxes
+    void route(const std::vector<int> &ready, int home, std::vector<int> &local) {
+        bool posted = false;
+        for (int c : ready) {
+            Chunk &ch = chunks_[c];
+            if (ch.worker == home || ch.worker == workers_ - 1) {
+                local.push_back(c);
+            } else {
+                SM_ThreadPool::instance().submit(ch.worker, &ch, group_, ctl_->options.priority);
+                posted = true;
+            }
+        }
+        if (posted) SM_ThreadPool::instance().flush();
+    }
+
+    // Run the chunks on `local` and every chunk they release into it
+    void run_chain(std::vector<int> &local, int home) {
+        std::vector<int> ready;
+        while (!local.empty()) {
+            int c = local.back();
+            local.pop_back();
+            execute(c);
+            ready.clear();
+            complete(c, ready);
+            route(ready, home, local);
+        }
+    }
+
+    static void chunk_entry(SM_PoolTask *task) {
+        Chunk *ch = static_cast<Chunk *>(task);
+        std::vector<int> local(1, ch->id);
+        ch->pipeline->run_chain(local, ch->worker);
+    }
+
+    int threads_;
+    int workers_;                          // threads_ capped by the caller's max_workers
+    std::vector<Stage> stages_;
+    std::vector<Chunk> chunks_;
+    std::unique_ptr<std::atomic<int>[]> waiting_;
+    std::unique_ptr<std::atomic<int>[]> stage_left_;
+    std::vector<int> succ_begin_;
+    std::vector<int> succ_;
+    SM_TaskGroup group_;
+    SM_CallControl *ctl_;
+#if SM_INSTRUMENTATION
+    SM_CallRecorder *rec_ = nullptr;
+#endif
+};
+
+#endif // SIMPLE_MULTITHREADER_H
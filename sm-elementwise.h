@@ -0,0 +1,186 @@
+#ifndef SM_ELEMENTWISE_H
+#define SM_ELEMENTWISE_H
+
+// sm-elementwise.h
+// Parallel element-wise kernels over contiguous arrays:
+//
+//   sm::fill(first, last, value [, numThreads, store])
+//   sm::transform(first, last, out, op [, numThreads, store])          out[i] = op(in[i])
+//   sm::transform(first1, last1, first2, out, op [, numThreads, store]) out[i] = op(a[i], b[i])
+//   sm::axpy(n, alpha, x, y [, numThreads, store])                     y[i] = alpha * x[i] + y[i]
+//
+// Every kernel splits its range statically: piece t of a call always runs on
+// the same thread, so an array filled by sm::fill is first touched (and its
+// pages placed) by the thread that later transforms that part of it, as long
+// as both calls use the same thread count. The inner loops are plain
+// indexed loops that -O3 vectorizes; large outputs are written with
+// non-temporal stores so they do not evict the inputs from cache. With
+// numThreads 0 those streamed calls also share the streaming schedule's
+// thread cap and placement, so they still split alike.
+
+#include "simple-multithreader.h"
+#include <cstring>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// How a kernel writes its output.
+//   auto  : stream when the output is larger than SM_STREAM_MIN_BYTES
+//           (0 = the L3 size from sysconf), cached otherwise
+//   cached: ordinary stores, for outputs read again soon
+//   stream: non-temporal stores, for outputs not read again before they
+//           would have left the cache anyway
+enum SM_StorePolicy { SM_STORE_AUTO, SM_STORE_CACHED, SM_STORE_STREAM };
+
+#ifndef SM_STREAM_MIN_BYTES
+#define SM_STREAM_MIN_BYTES 0
+#endif
+
+// numThreads 0 runs outputs below this many bytes on the caller and larger
+// ones on every CPU (always the same count, so fill and compute split alike)
+#ifndef SM_ELEMENTWISE_SERIAL_BYTES
+#define SM_ELEMENTWISE_SERIAL_BYTES (1 << 20)
+#endif
+
+// Bytes a streamed slice computes into a stack buffer before storing them
+#define SM_STREAM_BLOCK_BYTES 4096
+
+inline bool sm_stream_output(SM_StorePolicy store, size_t bytes) {
+    if (store != SM_STORE_AUTO) return store == SM_STORE_STREAM;
+    static const size_t limit =
+        SM_STREAM_MIN_BYTES > 0 ? SM_STREAM_MIN_BYTES : sm_cache_bytes(_SC_LEVEL3_CACHE_SIZE, 8L << 20);
+    return bytes > limit;
+}
+
+inline int sm_elementwise_threads(int numThreads, size_t bytes) {
+    if (numThreads < 0) return 1;
+    if (numThreads > 0) return numThreads;
+    return bytes < SM_ELEMENTWISE_SERIAL_BYTES ? 1 : sm_cpu_count();
+}
+
+// Copy count elements from src to 16-byte aligned dst with non-temporal
+// stores (count * sizeof(T) a multiple of 16); plain copy without SSE2
+template<typename T>
+inline void sm_stream_store(T *dst, const T *src, SM_Index count) {
+#if defined(__SSE2__)
+    __m128i *d = reinterpret_cast<__m128i *>(dst);
+    const char *s = reinterpret_cast<const char *>(src);
+    SM_Index vecs = count * static_cast<SM_Index>(sizeof(T)) / 16;
+    for (SM_Index v = 0; v < vecs; ++v) _mm_stream_si128(d + v, _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 16 * v)));
+#else
+    memcpy(dst, src, count * sizeof(T));
+#endif
+}
+
+inline void sm_stream_fence() {
+#if defined(__SSE2__)
+    _mm_sfence();
+#endif
+}
+
+// Whether T can go through sm_stream_store
+template<typename T>
+struct SM_Streamable {
+    static const bool value = std::is_trivially_copyable<T>::value && std::is_default_constructible<T>::value &&
+                              sizeof(T) <= 16 && 16 % sizeof(T) == 0;
+};
+
+// Write out[b, e) with gen(dst, i, len), which stores elements i .. i+len-1
+// of the result at dst[0 .. len). Streamed slices run gen into an L1-sized
+// buffer between an unaligned head and tail written in place.
+template<typename T, typename Gen>
+inline void sm_write_slice(T *out, SM_Index b, SM_Index e, bool stream, Gen &gen, std::true_type) {
+    if (!stream) {
+        gen(out + b, b, e - b);
+        return;
+    }
+    const SM_Index block = SM_STREAM_BLOCK_BYTES / sizeof(T);
+    SM_Index i = b;
+    SM_Index head = std::min<SM_Index>(e - b, ((16 - reinterpret_cast<uintptr_t>(out + b) % 16) % 16) / sizeof(T));
+    // an under-aligned T (alignof < sizeof) may never reach a 16-byte
+    // boundary on whole elements; such slices take ordinary stores
+    if (head < e - b && reinterpret_cast<uintptr_t>(out + b + head) % 16 != 0) {
+        gen(out + b, b, e - b);
+        return;
+    }
+    if (head > 0) gen(out + i, i, head);
+    i += head;
+    alignas(64) T buf[SM_STREAM_BLOCK_BYTES / sizeof(T)];
+    for (; e - i >= block; i += block) {
+        gen(buf, i, block);
+        sm_stream_store(out + i, buf, block);
+    }
+    SM_Index vec = (e - i) * static_cast<SM_Index>(sizeof(T)) / 16 * 16 / static_cast<SM_Index>(sizeof(T));
+    if (vec > 0) {
+        gen(buf, i, vec);
+        sm_stream_store(out + i, buf, vec);
+        i += vec;
+    }
+    if (i < e) gen(out + i, i, e - i);
+    sm_stream_fence();
+}
+
+template<typename T, typename Gen>
+inline void sm_write_slice(T *out, SM_Index b, SM_Index e, bool, Gen &gen, std::false_type) {
+    gen(out + b, b, e - b);
+}
+
+// Internal driver: out[0, n) = gen over a static split on numThreads threads.
+// With numThreads 0 a streamed output takes the streaming schedule: at most
+// sm_stream_threads() threads, one per physical core of a pinned pool.
+template<typename T, typename Gen>
+void sm_elementwise(T *out, SM_Index n, Gen gen, int numThreads, SM_StorePolicy store) {
+    if (n <= 0) return;
+    size_t bytes = static_cast<size_t>(n) * sizeof(T);
+    bool stream = sm_stream_output(store, bytes);
+    SM_Schedule sched = stream && numThreads == 0 ? sm_schedule_streaming() : sm_schedule_static();
+    parallel_for_range(SM_Index(0), n, [&](SM_Index b, SM_Index e) {
+        sm_write_slice(out, b, e, stream, gen, std::integral_constant<bool, SM_Streamable<T>::value>());
+    }, sm_elementwise_threads(numThreads, bytes), sched);
+}
+
+namespace sm {
+
+// [first, last) = value
+template<typename T>
+void fill(T *first, T *last, const typename std::remove_cv<T>::type &value, int numThreads = 0, SM_StorePolicy store = SM_STORE_AUTO) {
+    sm_elementwise(first, last - first, [&](T *d, SM_Index, SM_Index len) {
+        for (SM_Index j = 0; j < len; ++j) d[j] = value;
+    }, numThreads, store);
+}
+
+// out[i] = op(first[i]) for i in [0, last - first)
+template<typename In, typename Out, typename Op>
+void transform(const In *first, const In *last, Out *out, Op op, int numThreads = 0,
+               SM_StorePolicy store = SM_STORE_AUTO) {
+    sm_elementwise(out, last - first, [&](Out *d, SM_Index i, SM_Index len) {
+        const In *a = first + i;
+        for (SM_Index j = 0; j < len; ++j) d[j] = op(a[j]);
+    }, numThreads, store);
+}
+
+// out[i] = op(first1[i], first2[i]) for i in [0, last1 - first1)
+template<typename In1, typename In2, typename Out, typename Op>
+void transform(const In1 *first1, const In1 *last1, const In2 *first2, Out *out, Op op, int numThreads = 0,
+               SM_StorePolicy store = SM_STORE_AUTO) {
+    sm_elementwise(out, last1 - first1, [&](Out *d, SM_Index i, SM_Index len) {
+        const In1 *a = first1 + i;
+        const In2 *b = first2 + i;
+        for (SM_Index j = 0; j < len; ++j) d[j] = op(a[j], b[j]);
+    }, numThreads, store);
+}
+
+// y[i] = alpha * x[i] + y[i] for i in [0, n)
+template<typename T>
+void axpy(SM_Index n, typename std::remove_cv<T>::type alpha, const T *x, T *y, int numThreads = 0, SM_StorePolicy store = SM_STORE_AUTO) {
+    sm_elementwise(y, n, [&](T *d, SM_Index i, SM_Index len) {
+        const T *xs = x + i;
+        const T *ys = y + i;
+        for (SM_Index j = 0; j < len; ++j) d[j] = alpha * xs[j] + ys[j];
+    }, numThreads, store);
+}
+
+} // namespace sm
+
+#endif // SM_ELEMENTWISE_H
@@ -0,0 +1,281 @@
+#ifndef SM_GEMM_H
+#define SM_GEMM_H
+
+// sm-gemm.h
+// Blocked, packed and vectorized matrix multiply on contiguous row-major
+// storage, parallel over macro-tiles of C through the 2D parallel_for.
+// Compile with: g++ -std=c++11 -pthread ...
+//
+//   sm::gemm(M, N, K, A, lda, B, ldb, C, ldc)          C = A * B
+//   sm::gemm(M, N, K, alpha, A, lda, B, ldb, beta, C, ldc)
+//                                                      C = alpha * A * B + beta * C
+//
+// A is M x K, B is K x N and C is M x N; element type float, double or an
+// integer type. The micro-kernel is picked once at run time: AVX-512,
+// AVX2 + FMA or SSE2 on x86, the compiler's generic vectors elsewhere.
+
+#include "simple-multithreader.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SM_GEMM_X86 1
+#else
+#define SM_GEMM_X86 0
+#endif
+
+#define SM_GEMM_INLINE inline __attribute__((always_inline))
+
+// Instruction set of the micro-kernel in use
+enum SM_GemmIsa { SM_GEMM_GENERIC, SM_GEMM_AVX2, SM_GEMM_AVX512 };
+
+inline SM_GemmIsa sm_gemm_detect_isa() {
+#if SM_GEMM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SM_GEMM_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SM_GEMM_AVX2;
+#endif
+    return SM_GEMM_GENERIC;
+}
+
+// Set SM_GEMM_ISA=generic|avx2|avx512 to force a narrower kernel
+inline SM_GemmIsa sm_gemm_isa() {
+    static const SM_GemmIsa isa = [] {
+        SM_GemmIsa best = sm_gemm_detect_isa();
+        const char *env = getenv("SM_GEMM_ISA");
+        if (!env) return best;
+        SM_GemmIsa want = !strcmp(env, "avx512") ? SM_GEMM_AVX512 : !strcmp(env, "avx2") ? SM_GEMM_AVX2 : SM_GEMM_GENERIC;
+        return std::min(want, best);
+    }();
+    return isa;
+}
+
+// One macro-tile of C: rows [0, mc) x columns [0, nc) starting at c, over a
+// kc-deep slice. pa holds the tile's rows of A packed in MR-row panels
+// (k-major), pb the tile's columns of B packed in NR-column panels.
+template<typename T>
+struct SM_GemmTile {
+    SM_Index mc, nc, kc;
+    const T *pa;
+    const T *pb;
+    T alpha, beta;
+    T *c;
+    SM_Index ldc;
+};
+
+// Register-blocked kernel: an MR x NR block of C is held in MR x 2 vector
+// accumulators of VB bytes while a kc-long strip of A and B streams through
+template<typename T, int VB, int MR>
+struct SM_GemmKernel {
+    typedef T V __attribute__((vector_size(VB)));
+    static const int VL = VB / static_cast<int>(sizeof(T));
+    static const int NR = 2 * VL;
+
+    // c (row stride ldc) = alpha * a * b + beta * c; beta == 0 does not read c
+    static SM_GEMM_INLINE void micro(SM_Index kc, const T *a, const T *b, T alpha, T beta, T *c, SM_Index ldc) {
+        V acc[MR][2];
+        for (int r = 0; r < MR; ++r) acc[r][0] = acc[r][1] = V();
+        for (SM_Index k = 0; k < kc; ++k) {
+            V b0, b1;
+            memcpy(&b0, b + k * NR, VB);
+            memcpy(&b1, b + k * NR + VL, VB);
+            for (int r = 0; r < MR; ++r) {
+                T ar = a[k * MR + r];
+                acc[r][0] += ar * b0;
+                acc[r][1] += ar * b1;
+            }
+        }
+        for (int r = 0; r < MR; ++r) {
+            for (int v = 0; v < 2; ++v) {
+                V out = alpha * acc[r][v];
+                if (beta != T(0)) {
+                    V old;
+                    memcpy(&old, c + r * ldc + v * VL, VB);
+                    out += beta * old;
+                }
+                memcpy(c + r * ldc + v * VL, &out, VB);
+            }
+        }
+    }
+
+    // The whole tile: B micro-panels outer so each stays in L1 while it
+    // meets every A panel; partial blocks at the edges go through a buffer
+    static SM_GEMM_INLINE void tile(const SM_GemmTile<T> &t) {
+        for (SM_Index jr = 0; jr < t.nc; jr += NR) {
+            SM_Index nr = std::min<SM_Index>(NR, t.nc - jr);
+            const T *b = t.pb + jr * t.kc;
+            for (SM_Index ir = 0; ir < t.mc; ir += MR) {
+                SM_Index mr = std::min<SM_Index>(MR, t.mc - ir);
+                const T *a = t.pa + ir * t.kc;
+                T *c = t.c + ir * t.ldc + jr;
+                if (mr == MR && nr == NR) {
+                    micro(t.kc, a, b, t.alpha, t.beta, c, t.ldc);
+                    continue;
+                }
+                alignas(64) T buf[MR * NR];
+                micro(t.kc, a, b, T(1), T(0), buf, NR);
+                for (SM_Index i = 0; i < mr; ++i) {
+                    for (SM_Index j = 0; j < nr; ++j) {
+                        T out = t.alpha * buf[i * NR + j];
+                        c[i * t.ldc + j] = t.beta != T(0) ? out + t.beta * c[i * t.ldc + j] : out;
+                    }
+                }
+            }
+        }
+    }
+};
+
+// One entry per instruction set. With -std=c++11 GCC does not contract
+// a * b + c on its own, so the x86 kernels ask for it to get FMAs
+template<typename T>
+__attribute__((noinline)) void sm_gemm_tile_generic(const SM_GemmTile<T> &t) {
+    SM_GemmKernel<T, 16, 4>::tile(t);
+}
+#if SM_GEMM_X86
+template<typename T>
+__attribute__((noinline, target("avx2,fma"), optimize("fp-contract=fast"))) void sm_gemm_tile_avx2(const SM_GemmTile<T> &t) {
+    SM_GemmKernel<T, 32, 6>::tile(t);
+}
+template<typename T>
+__attribute__((noinline, target("avx512f"), optimize("fp-contract=fast"))) void sm_gemm_tile_avx512(const SM_GemmTile<T> &t) {
+    SM_GemmKernel<T, 64, 8>::tile(t);
+}
+#endif
+
+// Register block shape of the kernel for isa
+template<typename T>
+void sm_gemm_shape(SM_GemmIsa isa, int &mr, int &nr) {
+    int vb = isa == SM_GEMM_AVX512 ? 64 : isa == SM_GEMM_AVX2 ? 32 : 16;
+    mr = isa == SM_GEMM_AVX512 ? 8 : isa == SM_GEMM_AVX2 ? 6 : 4;
+    nr = 2 * vb / static_cast<int>(sizeof(T));
+}
+
+// Pack rows [0, mc) x columns [0, kc) of a (row stride lda) into MR-row
+// panels, k-major within a panel, zero-padding the last panel
+template<typename T>
+void sm_gemm_pack_a(const T *a, SM_Index lda, SM_Index mc, SM_Index kc, int mr, T *out) {
+    for (SM_Index ir = 0; ir < mc; ir += mr) {
+        SM_Index rows = std::min<SM_Index>(mr, mc - ir);
+        for (SM_Index k = 0; k < kc; ++k) {
+            for (SM_Index r = 0; r < rows; ++r) out[k * mr + r] = a[(ir + r) * lda + k];
+            for (SM_Index r = rows; r < mr; ++r) out[k * mr + r] = T(0);
+        }
+        out += mr * kc;
+    }
+}
+
+// Pack NR-column panel q of rows [0, kc) of b (row stride ldb, n columns),
+// k-major, zero-padding past column n
+template<typename T>
+void sm_gemm_pack_b(const T *b, SM_Index ldb, SM_Index n, SM_Index kc, int nr, SM_Index q, T *out) {
+    SM_Index j0 = q * nr;
+    SM_Index cols = std::min<SM_Index>(nr, n - j0);
+    out += q * nr * kc;
+    for (SM_Index k = 0; k < kc; ++k) {
+        const T *row = b + k * ldb + j0;
+        for (SM_Index j = 0; j < cols; ++j) out[k * nr + j] = row[j];
+        for (SM_Index j = cols; j < nr; ++j) out[k * nr + j] = T(0);
+    }
+}
+
+// Cache blocking for element size `bytes`: a kc x NR panel of B fills about
+// half of L1, an mc x kc block of A about half of L2; mc and nc are then cut
+// down until there are a few tiles per thread
+inline void sm_gemm_blocking(SM_Index m, SM_Index n, SM_Index k, size_t bytes, int mr, int nr, int threads,
+                             SM_Index &mc, SM_Index &nc, SM_Index &kc) {
+    static const long l1 = sm_cache_bytes(_SC_LEVEL1_DCACHE_SIZE, 32 * 1024);
+    static const long l2 = sm_cache_bytes(_SC_LEVEL2_CACHE_SIZE, 1024 * 1024);
+    kc = std::max<SM_Index>(16, std::min<SM_Index>(k, l1 / 2 / (nr * static_cast<long>(bytes))));
+    mc = std::max<SM_Index>(mr, (l2 / 2 / (kc * static_cast<long>(bytes))) / mr * mr);
+    nc = 512 / nr * nr;
+    mc = std::min(mc, (m + mr - 1) / mr * mr);
+    nc = std::min(nc, (n + nr - 1) / nr * nr);
+    while (threads > 1 && ((m + mc - 1) / mc) * ((n + nc - 1) / nc) < 2LL * threads) {
+        if (nc > 4 * nr) nc = (nc / 2 + nr - 1) / nr * nr;
+        else if (mc > 4 * mr) mc = (mc / 2 + mr - 1) / mr * mr;
+        else break;
+    }
+}
+
+// Internal driver: for each kc-deep slice of K, pack that slice of B once,
+// then run every mc x nc tile of C (packing its rows of A into the running
+// thread's arena) under the 2D parallel_for
+template<typename T>
+void sm_gemm(SM_Index m, SM_Index n, SM_Index k, T alpha, const T *a, SM_Index lda, const T *b, SM_Index ldb,
+             T beta, T *c, SM_Index ldc, int numThreads) {
+    static_assert(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value && sizeof(T) <= 8,
+                  "sm::gemm needs a float, double or integer element type");
+    if (m < 0 || n < 0 || k < 0) throw std::invalid_argument("sm::gemm: negative dimension");
+    if (lda < k || ldb < n || ldc < n) throw std::invalid_argument("sm::gemm: leading dimension too small");
+    if (m == 0 || n == 0) return;
+    // numThreads 0: serial below ~1 MFLOP, every CPU above
+    if (numThreads < 0) numThreads = 1;
+    if (numThreads == 0) numThreads = 2.0 * m * n * k < 1e6 ? 1 : sm_cpu_count();
+    if (k == 0 || alpha == T(0)) {
+        parallel_for(SM_Index(0), m, [=](SM_Index i) {
+            for (SM_Index j = 0; j < n; ++j) c[i * ldc + j] = beta != T(0) ? beta * c[i * ldc + j] : T(0);
+        }, numThreads);
+        return;
+    }
+
+    SM_GemmIsa isa = sm_gemm_isa();
+    void (*kernel)(const SM_GemmTile<T> &) = sm_gemm_tile_generic<T>;
+#if SM_GEMM_X86
+    if (isa == SM_GEMM_AVX512) kernel = sm_gemm_tile_avx512<T>;
+    else if (isa == SM_GEMM_AVX2) kernel = sm_gemm_tile_avx2<T>;
+#endif
+    int mr, nr;
+    sm_gemm_shape<T>(isa, mr, nr);
+    SM_Index mc, nc, kc;
+    sm_gemm_blocking(m, n, k, sizeof(T), mr, nr, numThreads, mc, nc, kc);
+
+    SM_Index panels = (n + nr - 1) / nr;
+    SM_Index row_tiles = (m + mc - 1) / mc, col_tiles = (n + nc - 1) / nc;
+    SM_ArenaScope scope;
+    T *pb = static_cast<T *>(scope.arena.alloc(panels * nr * kc * sizeof(T)));
+    for (SM_Index pc = 0; pc < k; pc += kc) {
+        SM_Index kb = std::min(kc, k - pc);
+        // later slices accumulate onto the first
+        T beta_pc = pc == 0 ? beta : T(1);
+        const T *bslice = b + pc * ldb;
+        parallel_for(SM_Index(0), panels, [=](SM_Index q) { sm_gemm_pack_b(bslice, ldb, n, kb, nr, q, pb); },
+                     numThreads);
+        parallel_for(SM_Index(0), row_tiles, SM_Index(0), col_tiles, [=](SM_Index ti, SM_Index tj) {
+            SM_GemmTile<T> t;
+            SM_Index i0 = ti * mc, j0 = tj * nc;
+            t.mc = std::min(mc, m - i0);
+            t.nc = std::min(nc, n - j0);
+            t.kc = kb;
+            SM_ArenaScope tile_scope;
+            T *pa = static_cast<T *>(tile_scope.arena.alloc((t.mc + mr - 1) / mr * mr * kb * sizeof(T)));
+            sm_gemm_pack_a(a + i0 * lda + pc, lda, t.mc, kb, mr, pa);
+            t.pa = pa;
+            t.pb = pb + j0 * kb;
+            t.alpha = alpha;
+            t.beta = beta_pc;
+            t.c = c + i0 * ldc + j0;
+            t.ldc = ldc;
+            kernel(t);
+        }, numThreads);
+    }
+}
+
+namespace sm {
+
+// C = alpha * A * B + beta * C on row-major storage. numThreads 0 lets the
+// routine choose; pass 1 for a serial call.
+template<typename T>
+void gemm(SM_Index M, SM_Index N, SM_Index K, T alpha, const T *A, SM_Index lda, const T *B, SM_Index ldb,
+          T beta, T *C, SM_Index ldc, int numThreads = 0) {
+    sm_gemm(M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, numThreads);
+}
+
+// C = A * B
+template<typename T>
+void gemm(SM_Index M, SM_Index N, SM_Index K, const T *A, SM_Index lda, const T *B, SM_Index ldb, T *C,
+          SM_Index ldc, int numThreads = 0) {
+    sm_gemm(M, N, K, T(1), A, lda, B, ldb, T(0), C, ldc, numThreads);
+}
+
+} // namespace sm
+
+#endif // SM_GEMM_H
@@ -0,0 +1,121 @@
+#ifndef SM_MATRIX_H
+#define SM_MATRIX_H
+
+// sm-matrix.h
+// sm::Matrix<T>: a rows x cols row-major matrix in one aligned buffer.
+//
+//   sm::Matrix<float> m(rows, cols [, value, numThreads]);
+//   parallel_for(0, m.rows(), 0, m.cols(), [&](long long i, long long j) { m(i, j) = ...; }, n);
+//
+// Rows are padded to a whole number of cache lines, plus one more line when
+// the row length in bytes is a multiple of 512, so walking down a column
+// does not land every row in the same few cache sets. The buffer is 64-byte
+// aligned (2 MB aligned and offered to transparent huge pages from 2 MB up)
+// and is initialized with sm::fill: a static split on the pool, so with the
+// same thread count each row's pages are first touched by the thread that a
+// static parallel_for over the matrix later gives that row to.
+
+#include "simple-multithreader.h"
+#include "sm-elementwise.h"
+#include <sys/mman.h>
+
+// Buffers at least this large are 2 MB aligned and madvise'd MADV_HUGEPAGE
+#ifndef SM_HUGE_PAGE_BYTES
+#define SM_HUGE_PAGE_BYTES (2L << 20)
+#endif
+
+// Row stride in elements for cols columns of elem_bytes each
+inline SM_Index sm_matrix_stride(SM_Index cols, size_t elem_bytes) {
+    SM_Index g = SM_CACHE_LINE, b = static_cast<SM_Index>(elem_bytes);
+    while (b != 0) {
+        SM_Index r = g % b;
+        g = b;
+        b = r;
+    }
+    // smallest element count that fills whole cache lines
+    SM_Index per_line = SM_CACHE_LINE / g;
+    SM_Index stride = (cols + per_line - 1) / per_line * per_line;
+    if (stride * static_cast<SM_Index>(elem_bytes) % 512 == 0) stride += per_line;
+    return stride;
+}
+
+namespace sm {
+
+template<typename T>
+class Matrix {
+    static_assert(std::is_trivially_copyable<T>::value, "sm::Matrix holds trivially copyable elements");
+
+public:
+    Matrix() : rows_(0), cols_(0), stride_(0), data_(nullptr) {}
+
+    // Every element (padding included) starts as value; numThreads follows
+    // sm::fill: 0 picks, 1 initializes serially
+    explicit Matrix(SM_Index rows, SM_Index cols, const T &value = T(), int numThreads = 0)
+        : rows_(0), cols_(0), stride_(0), data_(nullptr) {
+        allocate(rows, cols);
+        if (data_) sm::fill(data_, data_ + rows_ * stride_, value, numThreads);
+    }
+
+    // Copies keep the source's shape and stride; the copy runs on the pool
+    Matrix(const Matrix &other) : rows_(0), cols_(0), stride_(0), data_(nullptr) {
+        allocate(other.rows_, other.cols_);
+        if (data_) sm::transform(other.data_, other.data_ + rows_ * stride_, data_, [](const T &x) { return x; });
+    }
+
+    Matrix(Matrix &&other) noexcept : rows_(other.rows_), cols_(other.cols_), stride_(other.stride_), data_(other.data_) {
+        other.rows_ = other.cols_ = other.stride_ = 0;
+        other.data_ = nullptr;
+    }
+
+    Matrix &operator=(Matrix other) {
+        swap(other);
+        return *this;
+    }
+
+    ~Matrix() { free(data_); }
+
+    void swap(Matrix &other) noexcept {
+        std::swap(rows_, other.rows_);
+        std::swap(cols_, other.cols_);
+        std::swap(stride_, other.stride_);
+        std::swap(data_, other.data_);
+    }
+
+    SM_Index rows() const { return rows_; }
+    SM_Index cols() const { return cols_; }
+    // Distance in elements between the starts of consecutive rows (the
+    // leading dimension for sm::gemm)
+    SM_Index stride() const { return stride_; }
+
+    T *data() { return data_; }
+    const T *data() const { return data_; }
+
+    // m[i][j] and m(i, j) address the same element
+    T *operator[](SM_Index i) { return data_ + i * stride_; }
+    const T *operator[](SM_Index i) const { return data_ + i * stride_; }
+    T &operator()(SM_Index i, SM_Index j) { return data_[i * stride_ + j]; }
+    const T &operator()(SM_Index i, SM_Index j) const { return data_[i * stride_ + j]; }
+
+private:
+    void allocate(SM_Index rows, SM_Index cols) {
+        if (rows < 0 || cols < 0) throw std::invalid_argument("sm::Matrix: negative dimension");
+        if (rows == 0 || cols == 0) return;
+        SM_Index stride = sm_matrix_stride(cols, sizeof(T));
+        size_t bytes = static_cast<size_t>(sm_area_2d(rows, stride)) * sizeof(T);
+        bool huge = bytes >= static_cast<size_t>(SM_HUGE_PAGE_BYTES);
+        void *mem = nullptr;
+        if (posix_memalign(&mem, huge ? SM_HUGE_PAGE_BYTES : SM_CACHE_LINE, bytes) != 0) throw std::bad_alloc();
+        if (huge) madvise(mem, bytes, MADV_HUGEPAGE);
+        rows_ = rows;
+        cols_ = cols;
+        stride_ = stride;
+        data_ = static_cast<T *>(mem);
+    }
+
+    SM_Index rows_, cols_, stride_;
+    T *data_;
+};
+
+} // namespace sm
+
+#endif // SM_MATRIX_H
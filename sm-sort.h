@@ -0,0 +1,272 @@
+#ifndef SM_SORT_H
+#define SM_SORT_H
+
+// sm-sort.h
+// Parallel sort and partition of contiguous arrays on the shared pool:
+//
+//   sm::parallel_sort(first, last [, comp, numThreads])
+//   T *mid = sm::parallel_partition(first, last, pred [, numThreads])
+//
+// Integer keys sorted with std::less or std::greater take an LSD radix sort
+// (one 8-bit digit per pass); every other type or comparator takes a
+// samplesort. Both count per static piece, turn the counts into scatter
+// offsets with parallel_exclusive_scan and move each element once per pass
+// into a scratch buffer, so the pool is the only threading runtime involved.
+// Element moves must not throw.
+
+#include "simple-multithreader.h"
+#include <cstring>
+#include <stdint.h>
+#include <functional>
+#include <vector>
+#include <new>
+
+// numThreads 0: ranges shorter than this sort (or partition) serially,
+// longer ones use every CPU
+#ifndef SM_SORT_SERIAL_INDICES
+#define SM_SORT_SERIAL_INDICES (1 << 14)
+#endif
+
+// Samplesort cuts the keys into this many buckets per thread, so the
+// dynamically scheduled bucket sorts even out, and picks each splitter
+// from this many samples
+#define SM_SORT_BUCKETS_PER_THREAD 4
+#define SM_SORT_OVERSAMPLE 32
+
+inline int sm_sort_threads(int numThreads, SM_Index n) {
+    if (numThreads < 0) numThreads = 1;
+    if (numThreads == 0) numThreads = n < SM_SORT_SERIAL_INDICES ? 1 : sm_cpu_count();
+    return static_cast<int>(std::max<SM_Index>(1, std::min<SM_Index>(numThreads, n)));
+}
+
+// Run body(c, b, e) for static piece c = [b, e) of [0, n) cut chunks ways,
+// one piece per thread, so every pass over the same n sees the same pieces
+template<typename Body>
+inline void sm_sort_pieces(SM_Index n, int chunks, Body body) {
+    parallel_for_range(0, chunks, [&](int cb, int ce) {
+        for (int c = cb; c < ce; ++c) {
+            SM_Index b, e;
+            sm_piece(0, n, chunks, c, b, e);
+            body(c, b, e);
+        }
+    }, chunks, sm_schedule_static());
+}
+
+// Uninitialized scratch for n elements; the first `constructed` are
+// destroyed on release
+template<typename T>
+struct SM_SortBuffer {
+    T *data;
+    SM_Index constructed;
+    explicit SM_SortBuffer(SM_Index n) : data(static_cast<T *>(::operator new(sizeof(T) * n))), constructed(0) {}
+    ~SM_SortBuffer() {
+        for (SM_Index k = 0; k < constructed; ++k) data[k].~T();
+        ::operator delete(data);
+    }
+    SM_SortBuffer(const SM_SortBuffer &) = delete;
+    SM_SortBuffer &operator=(const SM_SortBuffer &) = delete;
+};
+
+// Move the n elements of scratch back into data, on the same pieces
+template<typename T>
+inline void sm_sort_move_back(SM_SortBuffer<T> &buf, T *data, SM_Index n, int chunks) {
+    sm_sort_pieces(n, chunks, [&](int, SM_Index b, SM_Index e) {
+        for (SM_Index i = b; i < e; ++i) {
+            data[i] = std::move(buf.data[i]);
+            buf.data[i].~T();
+        }
+    });
+    buf.constructed = 0;
+}
+
+// Unsigned radix key of an integer in the order of comp: the sign bit is
+// flipped for signed types, and every bit for std::greater
+template<typename T, typename Compare>
+struct SM_RadixKey {
+    static const bool value = false;
+};
+
+template<typename T>
+struct SM_RadixKey<T, std::less<T>> {
+    static const bool value = std::is_integral<T>::value && !std::is_same<T, bool>::value;
+    typedef typename std::make_unsigned<typename std::conditional<value, T, int>::type>::type U;
+    static U key(T x) {
+        U u = static_cast<U>(x);
+        return std::is_signed<T>::value ? u ^ (U(1) << (8 * sizeof(T) - 1)) : u;
+    }
+};
+
+template<typename T>
+struct SM_RadixKey<T, std::greater<T>> : SM_RadixKey<T, std::less<T>> {
+    typedef typename SM_RadixKey<T, std::less<T>>::U U;
+    static U key(T x) { return static_cast<U>(~SM_RadixKey<T, std::less<T>>::key(x)); }
+};
+
+// LSD radix sort, 8 bits per pass. Each pass histograms the static pieces
+// into counts[digit * chunks + piece], whose exclusive scan is where piece
+// c starts writing each digit, then scatters the pieces in order (so every
+// pass is stable). A pass whose digit is the same in every key is skipped.
+template<typename T, typename Key>
+void sm_radix_sort(T *data, SM_Index n, int chunks) {
+    SM_SortBuffer<T> buf(n);
+    std::vector<SM_Index> counts(256 * static_cast<size_t>(chunks));
+    T *src = data, *dst = buf.data;
+    for (int shift = 0; shift < static_cast<int>(8 * sizeof(T)); shift += 8) {
+        sm_sort_pieces(n, chunks, [&](int c, SM_Index b, SM_Index e) {
+            SM_Index hist[256] = {};
+            for (SM_Index i = b; i < e; ++i) ++hist[(Key::key(src[i]) >> shift) & 255];
+            for (int d = 0; d < 256; ++d) counts[d * chunks + c] = hist[d];
+        });
+        bool trivial = false;
+        for (int d = 0; d < 256 && !trivial; ++d) {
+            SM_Index total = 0;
+            for (int c = 0; c < chunks; ++c) total += counts[d * chunks + c];
+            trivial = total == n;
+        }
+        if (trivial) continue;
+        parallel_exclusive_scan(0, counts.size(), counts.data(), counts.data(), SM_Index(0), std::plus<SM_Index>(), 0);
+        sm_sort_pieces(n, chunks, [&](int c, SM_Index b, SM_Index e) {
+            SM_Index off[256];
+            for (int d = 0; d < 256; ++d) off[d] = counts[d * chunks + c];
+            for (SM_Index i = b; i < e; ++i) {
+                T x = src[i];
+                dst[off[(Key::key(x) >> shift) & 255]++] = x;
+            }
+        });
+        std::swap(src, dst);
+    }
+    if (src != data) {
+        sm_sort_pieces(n, chunks, [&](int, SM_Index b, SM_Index e) { memcpy(data + b, src + b, (e - b) * sizeof(T)); });
+    }
+}
+
+// Samplesort: up to ranges - 1 splitters are taken from a sorted
+// pseudo-random sample, equal ones only once (splitters point into data,
+// so T need not be copyable). S splitters make 2S + 1 buckets: bucket 2j
+// holds the keys between splitters j - 1 and j, bucket 2j + 1 the keys
+// equal to splitter j, which need no sorting, so few distinct keys still
+// spread over the pieces. Pass 1 records each element's bucket and counts
+// per piece, the counts are scanned into bucket-major offsets, pass 2
+// moves every element into its bucket in scratch, the range buckets are
+// sorted with std::sort under a dynamic schedule and all are moved back.
+template<typename T, typename Compare>
+void sm_sample_sort(T *data, SM_Index n, int chunks, Compare &comp) {
+    int ranges = static_cast<int>(std::min<SM_Index>(std::min(chunks * SM_SORT_BUCKETS_PER_THREAD, 32768), n));
+    std::vector<SM_Index> sample(static_cast<size_t>(ranges) * SM_SORT_OVERSAMPLE);
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for (size_t k = 0; k < sample.size(); ++k) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        sample[k] = static_cast<SM_Index>((x >> 16) % static_cast<uint64_t>(n));
+    }
+    std::sort(sample.begin(), sample.end(), [&](SM_Index a, SM_Index b) { return comp(data[a], data[b]); });
+    std::vector<const T *> splitters;
+    for (int s = 1; s < ranges; ++s) {
+        const T *sp = &data[sample[static_cast<size_t>(s) * SM_SORT_OVERSAMPLE]];
+        if (splitters.empty() || comp(*splitters.back(), *sp)) splitters.push_back(sp);
+    }
+    if (splitters.empty()) splitters.push_back(&data[sample[0]]);
+    int buckets = 2 * static_cast<int>(splitters.size()) + 1;
+
+    std::vector<uint16_t> ids(n);
+    std::vector<SM_Index> counts(static_cast<size_t>(buckets) * chunks);
+    sm_sort_pieces(n, chunks, [&](int c, SM_Index b, SM_Index e) {
+        std::vector<SM_Index> hist(buckets);
+        for (SM_Index i = b; i < e; ++i) {
+            // j = splitters not greater than data[i]; the last is equal or less
+            int j = static_cast<int>(
+                std::upper_bound(splitters.begin(), splitters.end(), &data[i],
+                                 [&](const T *v, const T *s) { return comp(*v, *s); }) -
+                splitters.begin());
+            int bucket = j > 0 && !comp(*splitters[j - 1], data[i]) ? 2 * j - 1 : 2 * j;
+            ids[i] = static_cast<uint16_t>(bucket);
+            ++hist[bucket];
+        }
+        for (int k = 0; k < buckets; ++k) counts[static_cast<size_t>(k) * chunks + c] = hist[k];
+    });
+    parallel_exclusive_scan(0, counts.size(), counts.data(), counts.data(), SM_Index(0), std::plus<SM_Index>(), 0);
+
+    SM_SortBuffer<T> buf(n);
+    sm_sort_pieces(n, chunks, [&](int c, SM_Index b, SM_Index e) {
+        std::vector<SM_Index> off(buckets);
+        for (int k = 0; k < buckets; ++k) off[k] = counts[static_cast<size_t>(k) * chunks + c];
+        for (SM_Index i = b; i < e; ++i) new (&buf.data[off[ids[i]]++]) T(std::move(data[i]));
+    });
+    buf.constructed = n;
+
+    parallel_for(0, buckets, [&](int k) {
+        if (k % 2) return; // keys equal to a splitter
+        SM_Index b = counts[static_cast<size_t>(k) * chunks];
+        SM_Index e = k + 1 < buckets ? counts[static_cast<size_t>(k + 1) * chunks] : n;
+        std::sort(buf.data + b, buf.data + e, comp);
+    }, chunks, sm_schedule_dynamic(1));
+    sm_sort_move_back(buf, data, n, chunks);
+}
+
+template<typename T, typename Compare>
+inline void sm_sort(T *data, SM_Index n, Compare &, int chunks, std::true_type) {
+    sm_radix_sort<T, SM_RadixKey<T, Compare>>(data, n, chunks);
+}
+
+template<typename T, typename Compare>
+inline void sm_sort(T *data, SM_Index n, Compare &comp, int chunks, std::false_type) {
+    sm_sample_sort(data, n, chunks, comp);
+}
+
+namespace sm {
+
+// Sort [first, last) by comp (not stable). numThreads 0 sorts short ranges
+// with std::sort on the caller and long ones on every CPU.
+template<typename T, typename Compare>
+void parallel_sort(T *first, T *last, Compare comp, int numThreads = 0) {
+    SM_Index n = last - first;
+    int chunks = sm_sort_threads(numThreads, n);
+    if (chunks <= 1) {
+        std::sort(first, last, comp);
+        return;
+    }
+    sm_sort(first, n, comp, chunks, std::integral_constant<bool, SM_RadixKey<T, Compare>::value>());
+}
+
+template<typename T>
+void parallel_sort(T *first, T *last) {
+    parallel_sort(first, last, std::less<T>());
+}
+
+// Reorder [first, last) so the elements satisfying pred come first, each
+// group in its original order (a stable partition); returns the end of the
+// first group. pred is called once per element: pass 1 records it per
+// piece and counts, one exclusive scan over [trues of every piece, falses
+// of every piece] gives each piece its two write positions, and pass 2
+// moves the elements to scratch, from where they are moved back.
+template<typename T, typename Pred>
+T *parallel_partition(T *first, T *last, Pred pred, int numThreads = 0) {
+    SM_Index n = last - first;
+    int chunks = sm_sort_threads(numThreads, n);
+    if (chunks <= 1) return std::stable_partition(first, last, pred);
+
+    std::vector<unsigned char> flags(n);
+    std::vector<SM_Index> counts(2 * static_cast<size_t>(chunks));
+    sm_sort_pieces(n, chunks, [&](int c, SM_Index b, SM_Index e) {
+        SM_Index yes = 0;
+        for (SM_Index i = b; i < e; ++i) {
+            flags[i] = pred(first[i]) ? 1 : 0;
+            yes += flags[i];
+        }
+        counts[c] = yes;
+        counts[chunks + c] = e - b - yes;
+    });
+    parallel_exclusive_scan(0, counts.size(), counts.data(), counts.data(), SM_Index(0), std::plus<SM_Index>(), 0);
+
+    SM_SortBuffer<T> buf(n);
+    sm_sort_pieces(n, chunks, [&](int c, SM_Index b, SM_Index e) {
+        SM_Index yes = counts[c], no = counts[chunks + c];
+        for (SM_Index i = b; i < e; ++i) new (&buf.data[flags[i] ? yes++ : no++]) T(std::move(first[i]));
+    });
+    buf.constructed = n;
+    sm_sort_move_back(buf, first, n, chunks);
+    return first + counts[chunks];
+}
+
+} // namespace sm
+
+#endif // SM_SORT_H
@@ -0,0 +1,130 @@
+// File: sort.cpp
+#include "simple-multithreader.h"
+#include "sm-sort.h"
+#include <assert.h>
+#include <cstdlib>
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
+// input shapes every check runs on: full-width random keys, the three keys
+// -1, 0, 1 (wrapped for unsigned types), and size down to 1
+enum Shape { RANDOM, FEW, DESCENDING };
+
+template<typename T>
+std::vector<T> make_keys(int size, Shape shape, std::mt19937_64 &rng) {
+  std::vector<T> v(size);
+  for (int i = 0; i < size; i++) {
+    unsigned long long r = rng();
+    if (shape == FEW) r = r % 3 - 1;
+    if (shape == DESCENDING) r = size - i;
+    v[i] = static_cast<T>(r);
+  }
+  return v;
+}
+
+// sm::parallel_sort must agree with std::sort (equal keys are equal values
+// here, so stability does not matter)
+template<typename T, typename Compare>
+void check_sort(int size, int threads, Compare comp, std::mt19937_64 &rng) {
+  for (Shape shape : {RANDOM, FEW, DESCENDING}) {
+    std::vector<T> a = make_keys<T>(size, shape, rng);
+    std::vector<T> b = a;
+    sm::parallel_sort(a.data(), a.data() + size, comp, threads);
+    std::sort(b.begin(), b.end(), comp);
+    assert(a == b);
+  }
+}
+
+// move-only elements take the samplesort; the pointers keep their keys
+void check_sort_move_only(int size, int threads, std::mt19937_64 &rng) {
+  for (Shape shape : {RANDOM, FEW, DESCENDING}) {
+    std::vector<int> keys = make_keys<int>(size, shape, rng);
+    std::vector<std::unique_ptr<int>> a(size);
+    for (int i = 0; i < size; i++) a[i].reset(new int(keys[i]));
+    sm::parallel_sort(a.data(), a.data() + size,
+                      [](const std::unique_ptr<int> &x, const std::unique_ptr<int> &y) { return *x < *y; }, threads);
+    std::sort(keys.begin(), keys.end());
+    for (int i = 0; i < size; i++) assert(*a[i] == keys[i]);
+  }
+}
+
+// sm::parallel_partition must match std::stable_partition element for element
+void check_partition(int size, int threads, std::mt19937_64 &rng) {
+  for (Shape shape : {RANDOM, FEW, DESCENDING}) {
+    std::vector<int> keys = make_keys<int>(size, shape, rng);
+    auto odd = [](int x) { return x % 2 != 0; };
+    std::vector<int> a = keys, b = keys;
+    int *mid = sm::parallel_partition(a.data(), a.data() + size, odd, threads);
+    int *ref = std::stable_partition(b.data(), b.data() + size, odd);
+    assert(mid - a.data() == ref - b.data());
+    assert(a == b);
+
+    std::vector<std::unique_ptr<int>> m(size);
+    for (int i = 0; i < size; i++) m[i].reset(new int(keys[i]));
+    sm::parallel_partition(m.data(), m.data() + size, [&](const std::unique_ptr<int> &p) { return odd(*p); }, threads);
+    for (int i = 0; i < size; i++) assert(*m[i] == b[i]);
+  }
+}
+
+// parallel_scan / parallel_exclusive_scan against a serial loop, over an
+// offset range [low, high), out of place and in place (unsigned sums wrap
+// exactly, so the reassociated SIMD path must match bit for bit)
+template<typename T>
+void check_scan(int size, int threads, std::mt19937_64 &rng) {
+  int low = std::min(size, 3), high = std::max(low, size - 5);
+  for (Shape shape : {RANDOM, FEW, DESCENDING}) {
+    std::vector<T> in = make_keys<T>(size, shape, rng);
+    std::vector<T> inc(in), exc(in);
+    T sum = T(0);
+    for (int i = low; i < high; i++) {
+      exc[i] = static_cast<T>(sum + T(7));
+      sum = static_cast<T>(sum + in[i]);
+      inc[i] = sum;
+    }
+    std::vector<T> out(in);
+    T total = parallel_scan(low, high, in.data(), out.data(), std::plus<T>(), threads);
+    assert(out == inc && (low == high || total == sum));
+    out = in;
+    T last = parallel_exclusive_scan(low, high, in.data(), out.data(), T(7), std::plus<T>(), threads);
+    assert(out == exc && last == static_cast<T>(sum + T(7)));
+    out = in;
+    parallel_scan(low, high, out.data(), out.data(), std::plus<T>(), threads);
+    assert(out == inc);
+    // a non-SIMD operator goes through the generic kernel
+    out = in;
+    parallel_scan(low, high, in.data(), out.data(), [](T x, T y) { return static_cast<T>(x + y); }, threads);
+    assert(out == inc);
+  }
+}
+
+int main(int argc, char** argv) {
+  // initialize problem size
+  // numThread 0 (the default) lets the library choose
+  int numThread = argc > 1 ? atoi(argv[1]) : 0;
+  int size = argc > 2 ? atoi(argv[2]) : 1 << 18;
+  std::mt19937_64 rng(42);
+  // the requested thread count, serial, and an odd count whose pieces differ
+  for (int threads : {numThread, 1, 3}) {
+    // radix: signed and unsigned keys of each width, both orders
+    check_sort<int>(size, threads, std::less<int>(), rng);
+    check_sort<int>(size, threads, std::greater<int>(), rng);
+    check_sort<signed char>(size, threads, std::less<signed char>(), rng);
+    check_sort<unsigned short>(size, threads, std::greater<unsigned short>(), rng);
+    check_sort<long long>(size, threads, std::less<long long>(), rng);
+    check_sort<unsigned long long>(size, threads, std::less<unsigned long long>(), rng);
+    // samplesort: other types and comparators
+    check_sort<double>(size, threads, std::less<double>(), rng);
+    check_sort<int>(size, threads, [](int x, int y) { return x / 2 < y / 2 || (x / 2 == y / 2 && x < y); }, rng);
+    check_sort_move_only(size, threads, rng);
+    check_partition(size, threads, rng);
+    check_scan<unsigned char>(size, threads, rng);
+    check_scan<unsigned short>(size, threads, rng);
+    check_scan<unsigned>(size, threads, rng);
+    check_scan<unsigned long long>(size, threads, rng);
+  }
+  printf("Test Success\n");
+  return 0;
+}
@@ -1,32 +1,36 @@
-// File: vector.cpp
-#include "simple-multithreader.h"
-#include <assert.h>
-#include <cstdlib>
-#include <algorithm>
-#include <cstdio>
-
-int main(int argc, char** argv) {
-  // initialize problem size
-  int numThread = argc > 1 ? atoi(argv[1]) : 2;
-  int size = argc > 2 ? atoi(argv[2]) : 48000000;
-  // allocate vectors
-  int* A = new int[size];
-  int* B = new int[size];
-  int* C = new int[size];
-  // initialize the vectors
-  std::fill(A, A + size, 1);
-  std::fill(B, B + size, 1);
-  std::fill(C, C + size, 0);
-  // start the parallel addition of two vectors
-  parallel_for(0, size, [&](int i) {
-    C[i] = A[i] + B[i];
-  }, numThread);
-  // verify the result vector
-  for (int i = 0; i < size; i++) assert(C[i] == 2);
-  printf("Test Success\n");
-  // cleanup memory
-  delete[] A;
-  delete[] B;
-  delete[] C;
-  return 0;
-}
+// File: vector.cpp
+#include "simple-multithreader.h"
+#include "sm-elementwise.h"
+#include <assert.h>
+#include <cstdlib>
+#include <algorithm>
+#include <cstdio>
+
+int main(int argc, char** argv) {
+  // initialize problem size
+  // numThread 0 (the default) lets the library choose
+  int numThread = argc > 1 ? atoi(argv[1]) : 0;
+  int size = argc > 2 ? atoi(argv[2]) : 48000000;
+  // allocate vectors
+  int* A = new int[size];
+  int* B = new int[size];
+  int* C = new int[size];
+  // print the timing of each parallel call
+  SM_PrintObserver printer;
+  sm_set_observer(&printer);
+  // initialize the vectors in parallel, so each page is first touched by
+  // the thread that adds that part of it below
+  sm::fill(A, A + size, 1, numThread);
+  sm::fill(B, B + size, 1, numThread);
+  sm::fill(C, C + size, 0, numThread);
+  // start the parallel addition of two vectors (C is streamed to memory)
+  sm::transform(A, A + size, B, C, [](int a, int b) { return a + b; }, numThread);
+  // verify the result vector
+  for (int i = 0; i < size; i++) assert(C[i] == 2);
+  printf("Test Success\n");
+  // cleanup memory
+  delete[] A;
+  delete[] B;
+  delete[] C;
+  return 0;
+}